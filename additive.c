@@ -0,0 +1,163 @@
+/*
+ *  additive.c  inharmonic additive engine of Piano.
+ *
+ *  Copyright (C) 2008 Tigran Aivazian <tigran@bibles.org.uk>
+ *
+ *  A stiff string's k-th partial sits at k * f0 * sqrt(1 + B k^2) rather
+ *  than at k * f0, and B grows towards the treble.  Each partial is a
+ *  rotating (cos, sin) pair advanced by a fixed rotation matrix, so a frame
+ *  costs four multiplies per partial instead of a sin().  Rounding makes
+ *  the pairs drift off the unit circle slowly; they are pulled back once
+ *  per render call.
+ *
+ *  The partials of a voice are stored as separate arrays, each padded to
+ *  whole groups of PARTIAL_GROUP, so the inner loop is a plain fixed-width
+ *  loop the compiler turns into vector code.  Partials above Nyquist are
+ *  never created and those that decay below AUDIBLE are dropped, so they
+ *  cost nothing.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "piano.h"
+
+#define MAXPARTIALS   64    /* per voice, a multiple of PARTIAL_GROUP */
+#define PARTIAL_GROUP 8     /* partials advanced together */
+#define AUDIBLE       3e-5  /* about -90dB of full scale */
+#define STRIKE        8     /* hammer at 1/STRIKE of the string */
+
+struct partials {
+   float c[MAXPARTIALS];     /* cos of each partial's phase */
+   float s[MAXPARTIALS];     /* sin of each partial's phase */
+   float cw[MAXPARTIALS];    /* cos and sin of the phase step per frame */
+   float sw[MAXPARTIALS];
+   float amp[MAXPARTIALS];
+   float decay[MAXPARTIALS]; /* amp multiplier per frame */
+   int live;                 /* partials still sounding, the rest are silent */
+   int count;                /* live rounded up to whole groups */
+} __attribute__((aligned(32)));
+
+static struct partials bank[POLYPHONY];
+
+/* make partial i silent, it still gets advanced if its group is in use */
+static void silence(struct partials *p, int i)
+{
+   p->c[i] = 1;
+   p->s[i] = 0;
+   p->cw[i] = 1;
+   p->sw[i] = 0;
+   p->amp[i] = 0;
+   p->decay[i] = 0;
+}
+
+static int groups_of(int n)
+{
+   return (n + PARTIAL_GROUP - 1) / PARTIAL_GROUP * PARTIAL_GROUP;
+}
+
+void additive_start(struct voice *v, const struct tuning *t)
+{
+   double freq = t->freq[v->note];
+   struct partials *p = &bank[v->id];
+   unsigned int rate = get_rate();
+   double key = (double)(v->note - MINMIDINOTE) / (NKEYS - 1); /* 0 bass, 1 treble */
+   double B = 1.5e-4 * pow(10.0, 1.8 * key);
+   double f0 = freq / sqrt(1 + B); /* so that the first partial is in tune */
+   double t60 = 12.0 * pow(0.08, key);
+   double fk, w, a, sum = 0;
+   int i, k;
+
+   p->live = 0;
+   for (k = 1; k <= MAXPARTIALS; k++) {
+      fk = k * f0 * sqrt(1 + B * k * k);
+      if (fk >= 0.45 * rate)
+         break; /* and so are all the ones above it */
+      a = fabs(sin(M_PI * k / STRIKE)) / k;
+      sum += a;
+      if (a == 0)
+         continue; /* in the hammer's notch */
+      i = p->live++;
+      w = 2 * M_PI * fk / rate;
+      p->c[i] = 1;
+      p->s[i] = 0;
+      p->cw[i] = cos(w);
+      p->sw[i] = sin(w);
+      p->amp[i] = a;
+      /* higher partials lose their energy sooner */
+      p->decay[i] = pow(0.001, 1.0 / (t60 / (1 + fk / 1000) * rate));
+   }
+
+   /* never louder than full scale, and drop what can't be heard from the start */
+   i = 0;
+   while (i < p->live) {
+      p->amp[i] /= sum;
+      if (p->amp[i] * v->amplitude < AUDIBLE) {
+         p->live--;
+         p->cw[i] = p->cw[p->live];
+         p->sw[i] = p->sw[p->live];
+         p->amp[i] = p->amp[p->live];
+         p->decay[i] = p->decay[p->live];
+      } else
+         i++;
+   }
+   p->count = groups_of(p->live);
+   for (i = p->live; i < p->count; i++)
+      silence(p, i);
+}
+
+/* move partial from into slot to, leaving from silent */
+static void move_partial(struct partials *p, int to, int from)
+{
+   p->c[to] = p->c[from];
+   p->s[to] = p->s[from];
+   p->cw[to] = p->cw[from];
+   p->sw[to] = p->sw[from];
+   p->amp[to] = p->amp[from];
+   p->decay[to] = p->decay[from];
+   silence(p, from);
+}
+
+int additive_render(struct voice *v, float *out, int count)
+{
+   struct partials *p = &bank[v->id];
+   float acc[PARTIAL_GROUP], sum, t, g;
+   int n, k, j, i;
+
+   for (n = 0; n < count; n++) {
+      for (j = 0; j < PARTIAL_GROUP; j++)
+         acc[j] = 0;
+      for (k = 0; k < p->count; k += PARTIAL_GROUP) {
+         for (j = 0; j < PARTIAL_GROUP; j++) {
+            i = k + j;
+            acc[j] += p->amp[i] * p->s[i];
+            t = p->c[i] * p->cw[i] - p->s[i] * p->sw[i];
+            p->s[i] = p->s[i] * p->cw[i] + p->c[i] * p->sw[i];
+            p->c[i] = t;
+            p->amp[i] *= p->decay[i];
+         }
+      }
+      sum = 0;
+      for (j = 0; j < PARTIAL_GROUP; j++)
+         sum += acc[j];
+      out[n] += v->amplitude * sum;
+   }
+
+   /* one Newton step towards c^2 + s^2 = 1 is plenty for a block's drift */
+   for (i = 0; i < p->count; i++) {
+      g = 1.5f - 0.5f * (p->c[i] * p->c[i] + p->s[i] * p->s[i]);
+      p->c[i] *= g;
+      p->s[i] *= g;
+   }
+
+   i = 0;
+   while (i < p->live) {
+      if (p->amp[i] * v->amplitude < AUDIBLE) {
+         p->live--;
+         move_partial(p, i, p->live);
+      } else
+         i++;
+   }
+   p->count = groups_of(p->live);
+   return p->live > 0;
+}
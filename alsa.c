@@ -0,0 +1,406 @@
+/*
+ *  alsa.c  ALSA PCM output backend of Piano.
+ *
+ *  Copyright (C) 2008 Tigran Aivazian <tigran@bibles.org.uk>
+ *
+ *  Periods are rendered straight into the device buffer when it can be
+ *  mapped (MMAP_INTERLEAVED or MMAP_NONINTERLEAVED), otherwise into a
+ *  buffer of our own that is copied with snd_pcm_writei().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <alsa/asoundlib.h>
+#include "piano.h"
+
+static snd_pcm_t *pcm;
+static snd_output_t *output;
+static const char *devname;
+static unsigned int rate;
+static unsigned int channels;
+static unsigned int buffer_time;	/* ring buffer length in microseconds */
+static unsigned int period_time;	/* period time in microseconds */
+static int resample;			/* enable alsa-lib resampling */
+static snd_pcm_sframes_t buffer_size;
+static snd_pcm_sframes_t period_size;
+static snd_pcm_access_t access_type;	/* mmap if the device allows it */
+static enum sample_format format;	/* the best the device takes unless asked for one */
+static const snd_pcm_format_t pcm_formats[NFORMATS] = {
+	SND_PCM_FORMAT_FLOAT, SND_PCM_FORMAT_S32, SND_PCM_FORMAT_S24_3LE, SND_PCM_FORMAT_S16,
+};
+static struct audio_area *areas;	/* our own buffer for RW access, ALSA's for mmap */
+static struct pollfd *ufds;		/* the PCM's poll descriptors and the wakeup eventfd */
+static int pcm_nfds;
+
+static int set_hwparams(snd_pcm_t *handle, snd_pcm_hw_params_t *params)
+{
+	unsigned int rrate;
+	snd_pcm_uframes_t size;
+	int err, dir;
+
+	/* choose all parameters */
+	err = snd_pcm_hw_params_any(handle, params);
+	if (err < 0) {
+		printf("Broken configuration for playback: no configurations available: %s\n", snd_strerror(err));
+		return err;
+	}
+	/* set hardware resampling */
+	err = snd_pcm_hw_params_set_rate_resample(handle, params, resample);
+	if (err < 0) {
+		printf("Resampling setup failed for playback: %s\n", snd_strerror(err));
+		return err;
+	}
+	/* render straight into the device buffer if it can be mapped,
+	   otherwise fall back to the interleaved read/write access */
+	access_type = SND_PCM_ACCESS_MMAP_INTERLEAVED;
+	err = snd_pcm_hw_params_set_access(handle, params, access_type);
+	if (err < 0) {
+		access_type = SND_PCM_ACCESS_MMAP_NONINTERLEAVED;
+		err = snd_pcm_hw_params_set_access(handle, params, access_type);
+	}
+	if (err < 0) {
+		access_type = SND_PCM_ACCESS_RW_INTERLEAVED;
+		err = snd_pcm_hw_params_set_access(handle, params, access_type);
+	}
+	if (err < 0) {
+		printf("Access type not available for playback: %s\n", snd_strerror(err));
+		return err;
+	}
+	/* set the sample format, the most precise one the device takes */
+	if (format == FMT_AUTO) {
+		for (format = 0; format < NFORMATS - 1; format++)
+			if (snd_pcm_hw_params_test_format(handle, params, pcm_formats[format]) == 0)
+				break;
+	}
+	err = snd_pcm_hw_params_set_format(handle, params, pcm_formats[format]);
+	if (err < 0) {
+		printf("Sample format not available for playback: %s\n", snd_strerror(err));
+		return err;
+	}
+	/* set the count of channels */
+	err = snd_pcm_hw_params_set_channels(handle, params, channels);
+	if (err < 0) {
+		printf("Channels count (%i) not available for playbacks: %s\n", channels, snd_strerror(err));
+		return err;
+	}
+	/* set the stream rate */
+	rrate = rate;
+	err = snd_pcm_hw_params_set_rate_near(handle, params, &rrate, 0);
+	if (err < 0) {
+		printf("Rate %iHz not available for playback: %s\n", rate, snd_strerror(err));
+		return err;
+	}
+	if (rrate != rate) {
+		printf("Rate doesn't match (requested %iHz, get %iHz)\n", rate, err);
+		return -EINVAL;
+	}
+	/* set the buffer time */
+	err = snd_pcm_hw_params_set_buffer_time_near(handle, params, &buffer_time, &dir);
+	if (err < 0) {
+		printf("Unable to set buffer time %i for playback: %s\n", buffer_time, snd_strerror(err));
+		return err;
+	}
+	err = snd_pcm_hw_params_get_buffer_size(params, &size);
+	if (err < 0) {
+		printf("Unable to get buffer size for playback: %s\n", snd_strerror(err));
+		return err;
+	}
+        buffer_size = size;
+	/* set the period time */
+	err = snd_pcm_hw_params_set_period_time_near(handle, params, &period_time, &dir);
+	if (err < 0) {
+		printf("Unable to set period time %i for playback: %s\n", period_time, snd_strerror(err));
+		return err;
+	}
+	err = snd_pcm_hw_params_get_period_size(params, &size, &dir);
+	if (err < 0) {
+		printf("Unable to get period size for playback: %s\n", snd_strerror(err));
+		return err;
+	}
+        period_size = size;
+	/* write the parameters to device */
+	err = snd_pcm_hw_params(handle, params);
+	if (err < 0) {
+		printf("Unable to set hw params for playback: %s\n", snd_strerror(err));
+		return err;
+	}
+	return 0;
+}
+
+static int set_swparams(snd_pcm_t *handle, snd_pcm_sw_params_t *swparams)
+{
+   int err;
+
+   /* get the current swparams */
+   err = snd_pcm_sw_params_current(handle, swparams);
+   if (err < 0) {
+      fprintf(stderr, "Unable to determine current swparams for playback: %s\n", snd_strerror(err));
+      return err;
+   }
+   /* start the transfer when the buffer is almost full: */
+   /* (buffer_size / avail_min) * avail_min */
+   err = snd_pcm_sw_params_set_start_threshold(handle, swparams, (buffer_size / period_size) * period_size);
+   if (err < 0) {
+      fprintf(stderr, "Unable to set start threshold mode for playback: %s\n", snd_strerror(err));
+      return err;
+   }
+   /* allow the transfer when at least period_size samples can be processed */
+   err = snd_pcm_sw_params_set_avail_min(handle, swparams, period_size);
+   if (err < 0) {
+      fprintf(stderr, "Unable to set avail min for playback: %s\n", snd_strerror(err));
+      return err;
+   }
+   /* write the parameters to the playback device */
+   err = snd_pcm_sw_params(handle, swparams);
+   if (err < 0) {
+      fprintf(stderr, "Unable to set sw params for playback: %s\n", snd_strerror(err));
+      return err;
+   }
+   return 0;
+}
+
+/* recover from underrun and suspend */
+static int xrun_recovery(int err)
+{
+   unsigned long long start = now_ns();
+
+   if (err == -EPIPE) { /* under-run */
+      err = snd_pcm_prepare(pcm);
+      if (err < 0)
+         fprintf(stderr, "Can't recover from underrun: %s\n", snd_strerror(err));
+      audio_count_xrun(0, start);
+      return 0;
+   } else if (err == -ESTRPIPE) {
+      while ((err = snd_pcm_resume(pcm)) == -EAGAIN)
+         sleep(1); /* wait until the suspend flag is released */
+      if (err < 0) {
+         err = snd_pcm_prepare(pcm);
+         if (err < 0)
+            fprintf(stderr, "Can't recover from suspend: %s\n", snd_strerror(err));
+      }
+      audio_count_xrun(1, start);
+      return 0;
+   }
+   return err;
+}
+
+static void write_error(const char *func, int err)
+{
+   if (xrun_recovery(err) < 0) {
+      fprintf(stderr, "%s: Write error: %s\n", func, snd_strerror(err));
+      exit(1);
+   }
+}
+
+static void alsa_open(const char *arg, unsigned long *buffer, unsigned long *period,
+                      enum sample_format *fmt)
+{
+   int err;
+   unsigned int chn, bits;
+   void *samples;
+   snd_pcm_hw_params_t *hwparams;
+   snd_pcm_sw_params_t *swparams;
+
+   devname = arg ? arg : get_pcm_devname();
+   rate = get_rate();
+   channels = get_channels();
+   buffer_time = get_buffer_time();
+   period_time = get_period_time();
+   resample = get_resample();
+   format = get_format();
+
+   snd_pcm_hw_params_alloca(&hwparams);
+   snd_pcm_sw_params_alloca(&swparams);
+
+   err = snd_output_stdio_attach(&output, stderr, 0);
+   if (err < 0) {
+      fprintf(stderr, "%s: attaching output failed: %s\n", __func__, snd_strerror(err));
+      exit(1);
+   }
+
+   err = snd_pcm_open(&pcm, devname, SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK);
+   if (err < 0) {
+      fprintf(stderr, "%s: Error opening PCM device %s: %s\n",
+         __func__, devname, snd_strerror(err));
+      exit(1);
+   }
+
+   if ((err = set_hwparams(pcm, hwparams)) < 0) {
+      fprintf(stderr, "%s: Can't set hwparams: %s\n", __func__, snd_strerror(err));
+      exit(1);
+   }
+
+   if ((err = set_swparams(pcm, swparams)) < 0) {
+      fprintf(stderr, "%s: Can't set swparams: %s\n", __func__, snd_strerror(err));
+      exit(1);
+   }
+
+   if (verbose) {
+      fprintf(stderr, "PCM device: %s\n", devname);
+      snd_pcm_dump(pcm, output);
+   }
+
+   areas = calloc(channels, sizeof(struct audio_area));
+   if (!areas) {
+      fprintf(stderr, "%s: Can't calloc memory for areas\n", __func__);
+      exit(1);
+   }
+
+   /* with mmap access ALSA hands out the areas for every period */
+   if (access_type == SND_PCM_ACCESS_RW_INTERLEAVED) {
+      bits = format_bits[format];
+      samples = malloc(period_size * channels * bits / 8);
+      if (!samples) {
+         fprintf(stderr, "%s: Can't malloc memory for samples\n", __func__);
+         exit(1);
+      }
+      for (chn = 0; chn < channels; chn++) {
+         areas[chn].addr = samples;
+         areas[chn].first = chn * bits;
+         areas[chn].step = channels * bits;
+      }
+   }
+
+   pcm_nfds = snd_pcm_poll_descriptors_count(pcm);
+   if (pcm_nfds <= 0) {
+      fprintf(stderr, "%s: Invalid poll descriptors count\n", __func__);
+      exit(1);
+   }
+   ufds = malloc((pcm_nfds + 1) * sizeof(struct pollfd));
+   if (!ufds) {
+      fprintf(stderr, "%s: Can't malloc memory for poll descriptors\n", __func__);
+      exit(1);
+   }
+   snd_pcm_poll_descriptors(pcm, ufds, pcm_nfds);
+
+   *buffer = buffer_size;
+   *period = period_size;
+   *fmt = format;
+}
+
+/* sleep until the device has room for a period or wakeup_fd fires */
+static void alsa_wait(int wakeup_fd)
+{
+   unsigned short revents;
+
+   ufds[pcm_nfds].fd = wakeup_fd;
+   ufds[pcm_nfds].events = POLLIN;
+   poll(ufds, pcm_nfds + 1, -1);
+   snd_pcm_poll_descriptors_revents(pcm, ufds, pcm_nfds, &revents);
+   if (revents & POLLERR)
+      write_error(__func__, snd_pcm_state(pcm) == SND_PCM_STATE_SUSPENDED ? -ESTRPIPE : -EPIPE);
+}
+
+static long alsa_avail(void)
+{
+   snd_pcm_sframes_t avail;
+
+   while ((avail = snd_pcm_avail_update(pcm)) < 0)
+      write_error(__func__, avail);
+   return avail;
+}
+
+static long alsa_delay(void)
+{
+   snd_pcm_sframes_t queued;
+
+   return (snd_pcm_delay(pcm, &queued) < 0) ? 0 : queued;
+}
+
+static int alsa_begin(const struct audio_area **my_areas, unsigned long *offset, unsigned long *frames)
+{
+   const snd_pcm_channel_area_t *pcm_areas;
+   unsigned int chn;
+   int err;
+
+   if (access_type == SND_PCM_ACCESS_RW_INTERLEAVED) {
+      if (*frames > (unsigned long)period_size)
+         *frames = period_size;
+      *offset = 0;
+      *my_areas = areas;
+      return 0;
+   }
+   err = snd_pcm_mmap_begin(pcm, &pcm_areas, offset, frames);
+   if (err < 0) {
+      write_error(__func__, err);
+      return -1;
+   }
+   for (chn = 0; chn < channels; chn++) {
+      areas[chn].addr = pcm_areas[chn].addr;
+      areas[chn].first = pcm_areas[chn].first;
+      areas[chn].step = pcm_areas[chn].step;
+   }
+   *my_areas = areas;
+   return 0;
+}
+
+static int alsa_commit(unsigned long offset, unsigned long frames)
+{
+   snd_pcm_sframes_t commitres;
+   unsigned char *ptr;
+   int err, cptr;
+
+   if (access_type != SND_PCM_ACCESS_RW_INTERLEAVED) {
+      commitres = snd_pcm_mmap_commit(pcm, offset, frames);
+      if (commitres < 0 || (snd_pcm_uframes_t)commitres != frames) {
+         write_error(__func__, commitres >= 0 ? -EPIPE : commitres);
+         return -1;
+      }
+      return 0;
+   }
+
+   ptr = areas->addr;
+   cptr = frames;
+   while (cptr > 0) {
+      err = snd_pcm_writei(pcm, ptr, cptr);
+      if (err == -EAGAIN) {
+         snd_pcm_wait(pcm, -1); /* only if the ring was fuller than poll() said */
+         continue;
+      }
+      if (err < 0) {
+         write_error(__func__, err);
+         return -1; /* skip one period */
+      }
+      ptr += err * channels * format_bits[format] / 8;
+      cptr -= err;
+   }
+   return 0;
+}
+
+/* the ring is full: start playing if the write didn't already */
+static void alsa_start(void)
+{
+   int err;
+
+   if (snd_pcm_state(pcm) == SND_PCM_STATE_PREPARED) {
+      err = snd_pcm_start(pcm);
+      if (err < 0) {
+         fprintf(stderr, "%s: Start error: %s\n", __func__, snd_strerror(err));
+         exit(1);
+      }
+   }
+}
+
+static void alsa_stop(void)
+{
+   snd_pcm_drop(pcm);
+   snd_pcm_prepare(pcm);
+}
+
+static void alsa_close(void)
+{
+   if (access_type == SND_PCM_ACCESS_RW_INTERLEAVED)
+      free(areas[0].addr);
+   free(areas);
+   free(ufds);
+   snd_pcm_close(pcm);
+}
+
+const struct backend alsa_backend = {
+   "alsa", alsa_open, alsa_wait, alsa_avail, alsa_delay,
+   alsa_begin, alsa_commit, alsa_start, alsa_stop, alsa_close,
+};
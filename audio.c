@@ -2,20 +2,34 @@
  *  audio.c  Audio output module of Piano.
  *
  *  Copyright (C) 2008 Tigran Aivazian <tigran@bibles.org.uk>
+ *
+ *  The audio thread renders periods and hands them to an output backend:
+ *  an ALSA device (alsa.c) or, for profiling and load tests on machines
+ *  without a sound card, a null or file sink (sinks.c).
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* CPU_SET() and pthread_attr_setaffinity_np() */
+#endif
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
-#include <string.h>
 #include <math.h>
 #include <errno.h>
 #include <pthread.h>
-#include <alsa/asoundlib.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include "piano.h"
 
-static snd_pcm_t *pcm;
-static snd_output_t *output;
+static const struct backend *backends[] = {
+   &alsa_backend, &null_backend, &clock_backend, &file_backend,
+};
+static const struct backend *backend = &alsa_backend;
+static char *backend_arg; /* what followed the ':' in -o, if anything */
+
 static pthread_t audio_thrid;
 static void *audio_thread(void *arg);
 
@@ -25,206 +39,183 @@ static unsigned int channels = 2;		/* number of channels */
 static unsigned int buffer_time = 50000;	/* ring buffer length in microseconds */
 static unsigned int period_time = 10000;	/* period time in microseconds */
 static int resample = 0;			/* enable alsa-lib resampling */
-static double freq;   /* sinusoidal wave frequency in Hz */
-static snd_pcm_sframes_t buffer_size;
-static snd_pcm_sframes_t period_size;
-static snd_pcm_channel_area_t *areas;
-
-const double max_phase = 2.0 * M_PI;
-static double phase_step;
-int max_signal_value = 0x7FFF; /* maximum value of a 16-bit signal */
-int signal_value = 0; /* current signal value */
+static int rt_priority = 0;			/* SCHED_FIFO priority of the audio thread, 0 = don't */
+static int audio_cpu = -1;			/* CPU to pin the audio thread to, -1 = any */
+static int lock_memory = 0;			/* mlock() the audio thread's buffers and stack */
+static enum sample_format format = FMT_AUTO;	/* the best the backend takes unless given */
+static unsigned long buffer_size;		/* as negotiated by the backend */
+static unsigned long period_size;
+static float *mix; /* mix of all active voices, a plane of period_size frames per channel */
+static void *conv; /* the mix converted to the output format, planes likewise */
+static struct dither dither;
+static unsigned long long period_start; /* when the last period was rendered */
+static int wakeup_fd = -1; /* eventfd the MIDI side pokes to wake an idle audio thread */
+static int quit;           /* set by audio_cleanup() to end the audio thread */
+
+const char *const format_names[NFORMATS] = { "float", "s32", "s24_3", "s16" };
+const unsigned int format_bits[NFORMATS] = { 32, 32, 24, 16 };
+
+#define STACK_PREFAULT (256*1024) /* bytes of audio thread stack touched up front */
+
+/* xrun accounting, written by the audio thread only */
+static struct {
+   unsigned long underruns;
+   unsigned long suspends;
+   unsigned long long recovery_ns;     /* total time spent recovering */
+   unsigned long long max_recovery_ns; /* longest single recovery */
+} xruns;
 
-static void generate_sine(const snd_pcm_channel_area_t *areas, int count, double *_phase)
+/*
+ * Render count frames into mix, applying every queued event on its own frame.
+ * An event that arrived 'x' ns after the previous period was rendered starts
+ * 'x' ns into this one, i.e. all events are delayed by exactly one period
+ * rather than snapped to period boundaries.
+ */
+static void render_mix(int count)
 {
-   double phase = *_phase;
-   double res;
-   unsigned char *samples[channels], *tmp;
-   int steps[channels];
-   unsigned int chn, byte;
-   int ires;
-	
-   /* prepare the contents of areas */
-   for (chn = 0; chn < channels; chn++) {
-      samples[chn] = (((unsigned char *)areas[chn].addr) + (areas[chn].first / 8));
-      steps[chn] = areas[chn].step / 8;
-   }
-   /* fill the channel areas */
-   while (count-- > 0) {
-      res = signal_value * sin(phase);
-      ires = res;
-      tmp = (unsigned char *)(&ires);
-      for (chn = 0; chn < channels; chn++) {
-         for (byte = 0; byte < 2; byte++)
-            *(samples[chn] + byte) = tmp[byte];
-         samples[chn] += steps[chn];
+   unsigned long long now = now_ns(), last = period_start;
+   struct note_event *ev;
+   long queued = -1; /* frames ahead of this period in the device */
+   int done = 0, frame;
+
+   period_start = now;
+   while ((ev = event_peek()) && ev->time <= now) {
+      frame = 0;
+      if (ev->time > last)
+         frame = (ev->time - last) * rate / 1000000000ULL;
+      if (frame > count - 1)
+         frame = count - 1;
+      if (frame > done) {
+         voices_render(mix + done, period_size, frame - done);
+         done = frame;
+      }
+      switch (ev->type) {
+         case EV_NOTEON:
+            voice_on(ev->note, ev->velocity);
+            /* it is heard once the frames already queued and 'frame' have played */
+            if (queued < 0)
+               queued = backend->delay();
+            latency_record(ev->time, now + (queued + frame + reverb_latency()) * 1000000000ULL / rate);
+            break;
+         case EV_NOTEOFF:
+            voice_off(ev->note);
+            break;
+         case EV_SUSTAIN:
+            voice_sustain(ev->velocity);
+            break;
       }
-      phase += phase_step;
-      if (phase >= max_phase)
-         phase -= max_phase;
+      event_pop();
    }
-   *_phase = phase;
+   voices_render(mix + done, period_size, count - done);
+   reverb_process(mix, period_size, count);
 }
 
-static int set_hwparams(snd_pcm_t *handle, snd_pcm_hw_params_t *params)
+/* whether areas describe one plain interleaved buffer */
+static int areas_interleaved(const struct audio_area *areas)
 {
-	unsigned int rrate;
-	snd_pcm_uframes_t size;
-	int err, dir;
-
-	/* choose all parameters */
-	err = snd_pcm_hw_params_any(handle, params);
-	if (err < 0) {
-		printf("Broken configuration for playback: no configurations available: %s\n", snd_strerror(err));
-		return err;
-	}
-	/* set hardware resampling */
-	err = snd_pcm_hw_params_set_rate_resample(handle, params, resample);
-	if (err < 0) {
-		printf("Resampling setup failed for playback: %s\n", snd_strerror(err));
-		return err;
-	}
-	/* set the interleaved read/write format */
-	err = snd_pcm_hw_params_set_access(handle, params, SND_PCM_ACCESS_RW_INTERLEAVED);
-	if (err < 0) {
-		printf("Access type not available for playback: %s\n", snd_strerror(err));
-		return err;
-	}
-	/* set the sample format */
-	err = snd_pcm_hw_params_set_format(handle, params, SND_PCM_FORMAT_S16);
-	if (err < 0) {
-		printf("Sample format not available for playback: %s\n", snd_strerror(err));
-		return err;
-	}
-	/* set the count of channels */
-	err = snd_pcm_hw_params_set_channels(handle, params, channels);
-	if (err < 0) {
-		printf("Channels count (%i) not available for playbacks: %s\n", channels, snd_strerror(err));
-		return err;
-	}
-	/* set the stream rate */
-	rrate = rate;
-	err = snd_pcm_hw_params_set_rate_near(handle, params, &rrate, 0);
-	if (err < 0) {
-		printf("Rate %iHz not available for playback: %s\n", rate, snd_strerror(err));
-		return err;
-	}
-	if (rrate != rate) {
-		printf("Rate doesn't match (requested %iHz, get %iHz)\n", rate, err);
-		return -EINVAL;
-	}
-	/* set the buffer time */
-	err = snd_pcm_hw_params_set_buffer_time_near(handle, params, &buffer_time, &dir);
-	if (err < 0) {
-		printf("Unable to set buffer time %i for playback: %s\n", buffer_time, snd_strerror(err));
-		return err;
-	}
-	err = snd_pcm_hw_params_get_buffer_size(params, &size);
-	if (err < 0) {
-		printf("Unable to get buffer size for playback: %s\n", snd_strerror(err));
-		return err;
-	}
-        buffer_size = size;
-	/* set the period time */
-	err = snd_pcm_hw_params_set_period_time_near(handle, params, &period_time, &dir);
-	if (err < 0) {
-		printf("Unable to set period time %i for playback: %s\n", period_time, snd_strerror(err));
-		return err;
-	}
-	err = snd_pcm_hw_params_get_period_size(params, &size, &dir);
-	if (err < 0) {
-		printf("Unable to get period size for playback: %s\n", snd_strerror(err));
-		return err;
-	}
-        period_size = size;
-	/* write the parameters to device */
-	err = snd_pcm_hw_params(handle, params);
-	if (err < 0) {
-		printf("Unable to set hw params for playback: %s\n", snd_strerror(err));
-		return err;
-	}
-	return 0;
+   unsigned int chn, bits = format_bits[format];
+
+   for (chn = 0; chn < channels; chn++)
+      if (areas[chn].addr != areas[0].addr || areas[chn].first != chn * bits ||
+          areas[chn].step != channels * bits)
+         return 0;
+   return 1;
 }
 
-static int set_swparams(snd_pcm_t *handle, snd_pcm_sw_params_t *swparams)
+/*
+ * Render count frames into areas, starting offset frames in.  With mmap
+ * access the areas are the device's own buffer, so this is the only copy.
+ */
+static void generate_sine(const struct audio_area *areas, unsigned long offset, int count)
 {
-   int err;
+   unsigned int chn, step, bytes = format_bits[format] / 8;
+   unsigned char *dst;
+   void *in[channels];
+   int n;
 
-   /* get the current swparams */
-   err = snd_pcm_sw_params_current(handle, swparams);
-   if (err < 0) {
-      fprintf(stderr, "Unable to determine current swparams for playback: %s\n", snd_strerror(err));
-      return err;
-   }
-   /* start the transfer when the buffer is almost full: */
-   /* (buffer_size / avail_min) * avail_min */
-   err = snd_pcm_sw_params_set_start_threshold(handle, swparams, (buffer_size / period_size) * period_size);
-   if (err < 0) {
-      fprintf(stderr, "Unable to set start threshold mode for playback: %s\n", snd_strerror(err));
-      return err;
+   render_mix(count);
+   for (chn = 0; chn < channels; chn++) {
+      in[chn] = (unsigned char *)conv + chn * period_size * bytes;
+      convert(format, in[chn], mix + chn * period_size, count, &dither);
    }
-   /* allow the transfer when at least period_size samples can be processed */
-   err = snd_pcm_sw_params_set_avail_min(handle, swparams, period_size);
-   if (err < 0) {
-      fprintf(stderr, "Unable to set avail min for playback: %s\n", snd_strerror(err));
-      return err;
+   if (areas_interleaved(areas)) {
+      kernels.interleave((unsigned char *)areas[0].addr + offset * channels * bytes,
+                         in, channels, count, bytes);
+      return;
    }
-   /* write the parameters to the playback device */
-   err = snd_pcm_sw_params(handle, swparams);
-   if (err < 0) {
-      fprintf(stderr, "Unable to set sw params for playback: %s\n", snd_strerror(err));
-      return err;
+   for (chn = 0; chn < channels; chn++) {
+      dst = (unsigned char *)areas[chn].addr + (areas[chn].first + offset * areas[chn].step) / 8;
+      step = areas[chn].step / 8;
+      for (n = 0; n < count; n++, dst += step)
+         memcpy(dst, (unsigned char *)in[chn] + n * bytes, bytes);
    }
-   return 0;
 }
 
-/* recover from underrun and suspend */
-static int xrun_recovery(int err)
+/* called by the backend after recovering from an underrun or a suspend at 'start' */
+void audio_count_xrun(int suspend, unsigned long long start)
 {
-   if (err == -EPIPE) { /* under-run */
-      err = snd_pcm_prepare(pcm);
-      if (err < 0)
-         fprintf(stderr, "Can't recover from underrun: %s\n", snd_strerror(err));
-         return 0;
-      } else if (err == -ESTRPIPE) {
-         while ((err = snd_pcm_resume(pcm)) == -EAGAIN)
-            sleep(1); /* wait until the suspend flag is released */
-         if (err < 0) {
-            err = snd_pcm_prepare(pcm);
-            if (err < 0)
-               fprintf(stderr, "Can't recover from suspend: %s\n", snd_strerror(err));
-         }
-         return 0;
-      }
-   return err;
+   unsigned long long t = now_ns() - start;
+   unsigned long *counter = suspend ? &xruns.suspends : &xruns.underruns;
+
+   __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+   __atomic_store_n(&xruns.recovery_ns, xruns.recovery_ns + t, __ATOMIC_RELAXED);
+   if (t > xruns.max_recovery_ns)
+      __atomic_store_n(&xruns.max_recovery_ns, t, __ATOMIC_RELAXED);
 }
 
-static void stream_audio(snd_pcm_channel_area_t *areas)
+void audio_print_stats(FILE *f)
 {
-   signed short *ptr;
-   int err, cptr;
-   double current_phase = 0;
-
-   if (!signal_value) return;
-
-   while (1) {
-      generate_sine(areas, period_size, &current_phase);
-      ptr = areas->addr;
-      cptr = period_size;
-      while (cptr > 0) {
-         err = snd_pcm_writei(pcm, ptr, cptr);
-         if (err == -EAGAIN) continue;
-         if (err < 0) {
-            if (xrun_recovery(err) < 0) {
-               fprintf(stderr, "%s: Write error: %s\n", __func__, snd_strerror(err));
-               exit(1);
-            }
-            break; /* skip one period */
-         }
-         ptr += err * channels;
-         cptr -= err;
+   fprintf(f, "xruns: %lu underruns, %lu suspends, recovery %.3fms total, %.3fms max\n",
+      __atomic_load_n(&xruns.underruns, __ATOMIC_RELAXED),
+      __atomic_load_n(&xruns.suspends, __ATOMIC_RELAXED),
+      __atomic_load_n(&xruns.recovery_ns, __ATOMIC_RELAXED) / 1e6,
+      __atomic_load_n(&xruns.max_recovery_ns, __ATOMIC_RELAXED) / 1e6);
+}
+
+/*
+ * Render a period into every whole period of room in the ring.  Once the
+ * ring holds nothing but silence, stop the backend and return 1: there is
+ * nothing left to play until audio_wakeup() is called.
+ */
+static int fill_ring(void)
+{
+   static unsigned long silent_periods;
+   const struct audio_area *areas;
+   unsigned long offset, frames, size;
+
+   while (backend->avail() >= (long)period_size) {
+      /* a period may be split where the ring wraps */
+      for (size = period_size; size > 0; size -= frames) {
+         frames = size;
+         if (backend->begin(&areas, &offset, &frames) < 0)
+            break;
+         generate_sine(areas, offset, frames);
+         if (backend->commit(offset, frames) < 0)
+            break;
+      }
+      if (size)
+         continue; /* xrun, the ring has been reset */
+
+      if (voices_active() || event_peek() || reverb_ringing())
+         silent_periods = 0;
+      else if (++silent_periods > buffer_size / period_size) {
+         /* the last audible period has played out */
+         silent_periods = 0;
+         backend->stop();
+         return 1;
       }
    }
+   backend->start();
+   return 0;
+}
+
+/* called after queueing an event, wakes the audio thread if it is idle */
+void audio_wakeup(void)
+{
+   unsigned long long one = 1;
+
+   if (wakeup_fd >= 0 && write(wakeup_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+      fprintf(stderr, "%s: write: %s\n", __func__, strerror(errno));
 }
 
 void set_rate(unsigned int r)
@@ -263,6 +254,23 @@ void set_period_time(unsigned int p)
       period_time = p;
 }
 
+void set_format(char *name)
+{
+   int f;
+
+   for (f = 0; f < NFORMATS; f++) {
+      if (!strcmp(name, format_names[f])) {
+         format = f;
+         return;
+      }
+   }
+   fprintf(stderr, "piano: unknown sample format \"%s\", must be one of:", name);
+   for (f = 0; f < NFORMATS; f++)
+      fprintf(stderr, " %s", format_names[f]);
+   fprintf(stderr, "\n");
+   exit(1);
+}
+
 void set_pcm_devname(char *name)
 {
    devname = strdup(name);
@@ -273,88 +281,229 @@ void set_resample(void)
    resample = 1;
 }
 
+/* spec is a backend name, optionally followed by ':' and its argument */
+void set_backend(char *spec)
+{
+   char *colon = strchr(spec, ':');
+   size_t len = colon ? (size_t)(colon - spec) : strlen(spec);
+   unsigned int i;
+
+   for (i = 0; i < sizeof(backends)/sizeof(backends[0]); i++) {
+      if (strlen(backends[i]->name) == len && !strncmp(spec, backends[i]->name, len)) {
+         backend = backends[i];
+         backend_arg = colon ? strdup(colon + 1) : NULL;
+         return;
+      }
+   }
+   fprintf(stderr, "piano: unknown output \"%s\", must be one of:", spec);
+   for (i = 0; i < sizeof(backends)/sizeof(backends[0]); i++)
+      fprintf(stderr, " %s", backends[i]->name);
+   fprintf(stderr, "\n");
+   exit(1);
+}
+
+void set_rt_priority(int p)
+{
+   if (p < MINRTPRIO || p > MAXRTPRIO) {
+      fprintf(stderr, "piano: invalid realtime priority = %d, must be within [%d...%d]\n", p, MINRTPRIO, MAXRTPRIO);
+      exit(1);
+   } else
+      rt_priority = p;
+}
+
+void set_audio_cpu(int cpu)
+{
+   int ncpus = sysconf(_SC_NPROCESSORS_CONF);
+
+   if (cpu < 0 || cpu >= ncpus || cpu >= CPU_SETSIZE) {
+      fprintf(stderr, "piano: invalid CPU = %d, must be within [0...%d]\n", cpu, ncpus - 1);
+      exit(1);
+   } else
+      audio_cpu = cpu;
+}
+
+void set_lock_memory(void)
+{
+   lock_memory = 1;
+}
+
+/*
+ * Keep size bytes at p resident if -L asked for it.  Only what the audio
+ * thread works on is locked, sample files stay paged in on demand.
+ */
+void audio_lock(const void *p, size_t size)
+{
+   static int warned;
+
+   if (lock_memory && size && mlock(p, size) == -1 && !warned++)
+      fprintf(stderr, "%s: mlock: %s\n", __func__, strerror(errno));
+}
+
+/* touch the stack the audio thread may grow into, so it never page faults */
+static void prefault_stack(void)
+{
+   unsigned char stack[STACK_PREFAULT];
+
+   memset(stack, 0, sizeof(stack));
+   __asm__ __volatile__("" : : "r"(stack) : "memory"); /* keep the memset */
+   audio_lock(stack, sizeof(stack));
+}
+
+/*
+ * Sleep in poll() until the device has room for a period or an event
+ * arrives.  While silent, the device is stopped and only the eventfd is
+ * polled, so an idle piano costs no CPU at all.
+ */
 static void *audio_thread(void *arg ATTRIBUTE_UNUSED)
 {
-   while (!stop_pending())
-      stream_audio(areas);
+   struct pollfd wakeup = { wakeup_fd, POLLIN, 0 };
+   unsigned long long events;
+   int idle = 1;
+
+   if (lock_memory)
+      prefault_stack();
+
+   while (!stop_pending() && !__atomic_load_n(&quit, __ATOMIC_ACQUIRE)) {
+      if (idle)
+         poll(&wakeup, 1, -1);
+      else
+         backend->wait(wakeup_fd);
+
+      while (read(wakeup_fd, &events, sizeof(events)) > 0)
+         ;
+      if (idle) {
+         if (!voices_active() && !event_peek())
+            continue;
+         idle = 0;
+         period_start = now_ns();
+      }
+      idle = fill_ring();
+   }
    return 0;
 }
 
-void set_freq(double f)
+unsigned int get_rate(void)
 {
-   freq = f;
-   phase_step = max_phase*freq/(double)rate;
+   return rate;
 }
 
-void audio_init(void)
+unsigned int get_channels(void)
 {
-   int err;
-   unsigned int chn;
-   signed short *samples;
-   snd_pcm_hw_params_t *hwparams;
-   snd_pcm_sw_params_t *swparams;
+   return channels;
+}
 
-   snd_pcm_hw_params_alloca(&hwparams);
-   snd_pcm_sw_params_alloca(&swparams);
+/* the format asked for, FMT_AUTO before audio_init() if none was */
+enum sample_format get_format(void)
+{
+   return format;
+}
 
-   err = snd_output_stdio_attach(&output, stderr, 0);
-   if (err < 0) {
-      fprintf(stderr, "%s: attaching output failed: %s\n", __func__, snd_strerror(err));
-      exit(1);
-   }
+unsigned int get_buffer_time(void)
+{
+   return buffer_time;
+}
 
-   err = snd_pcm_open(&pcm, devname, SND_PCM_STREAM_PLAYBACK, 0);
-   if (err < 0) {
-      fprintf(stderr, "%s: Error opening PCM device %s: %s\n",
-         __func__, devname, snd_strerror(err));
-      exit(1);
-   }
+unsigned int get_period_time(void)
+{
+   return period_time;
+}
 
-   if ((err = set_hwparams(pcm, hwparams)) < 0) {
-      fprintf(stderr, "%s: Can't set hwparams: %s\n", __func__, snd_strerror(err));
-      exit(1);
-   }
+const char *get_pcm_devname(void)
+{
+   return devname;
+}
 
-   if ((err = set_swparams(pcm, swparams)) < 0) {
-      fprintf(stderr, "%s: Can't set swparams: %s\n", __func__, snd_strerror(err));
-      exit(1);
-   }
+int get_resample(void)
+{
+   return resample;
+}
 
-   if (verbose) {
-      fprintf(stderr, "PCM device: %s\n", devname);
-      snd_pcm_dump(pcm, output);
+/* start audio_thread with the scheduling the user asked for */
+static void start_audio_thread(void)
+{
+   pthread_attr_t attr;
+   struct sched_param param;
+   cpu_set_t cpus;
+   int err;
+
+   pthread_attr_init(&attr);
+   if (rt_priority) {
+      param.sched_priority = rt_priority;
+      pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+      pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+      pthread_attr_setschedparam(&attr, &param);
+   }
+   if (audio_cpu >= 0) {
+      CPU_ZERO(&cpus);
+      CPU_SET(audio_cpu, &cpus);
+      pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
    }
 
-   samples = malloc(period_size * channels * 2);
-   if (!samples) {
-      fprintf(stderr, "%s: Can't malloc memory for samples\n", __func__);
+   err = pthread_create(&audio_thrid, &attr, audio_thread, NULL);
+   if (err == EPERM && rt_priority) {
+      fprintf(stderr, "%s: not permitted to use SCHED_FIFO, running with normal priority\n", __func__);
+      pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+      err = pthread_create(&audio_thrid, &attr, audio_thread, NULL);
+   }
+   if (err) {
+      fprintf(stderr, "%s: Error creating thread: %s\n", __func__, strerror(err));
       exit(1);
    }
+   pthread_attr_destroy(&attr);
+
+   if (verbose && (rt_priority || audio_cpu >= 0))
+      fprintf(stderr, "Audio thread: %s priority %d, CPU %d\n",
+         rt_priority ? "SCHED_FIFO" : "normal", rt_priority, audio_cpu);
+}
+
+void audio_init(void)
+{
+   backend->open(backend_arg, &buffer_size, &period_size, &format);
+   if (verbose)
+      fprintf(stderr, "Sample format: %s\n", format_names[format]);
+
+   wavetable_init(rate);
+   reverb_init(period_size);
 
-   areas = calloc(channels, sizeof(snd_pcm_channel_area_t));
-   if (!areas) {
-      fprintf(stderr, "%s: Can't calloc memory for areas\n", __func__);
+   mix = malloc(channels * period_size * sizeof(float));
+   if (!mix) {
+      fprintf(stderr, "%s: Can't malloc memory for mix\n", __func__);
       exit(1);
    }
 
-   set_freq(440.0); /* A4 */
-
-   for (chn = 0; chn < channels; chn++) {
-      areas[chn].addr = samples;
-      areas[chn].first = chn * 16;
-      areas[chn].step = channels * 16;
+   conv = malloc(channels * period_size * format_bits[format] / 8);
+   if (!conv) {
+      fprintf(stderr, "%s: Can't malloc memory for conv\n", __func__);
+      exit(1);
    }
+   dither_init(&dither);
 
-   err = pthread_create(&audio_thrid, NULL, audio_thread, NULL);
-   if (err < 0) {
-      fprintf(stderr, "%s: Error creating thread: %s\n", __func__, strerror(errno));
+   wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if (wakeup_fd == -1) {
+      fprintf(stderr, "%s: eventfd: %s\n", __func__, strerror(errno));
       exit(1);
    }
+
+   audio_lock(mix, channels * period_size * sizeof(float));
+   audio_lock(conv, channels * period_size * format_bits[format] / 8);
+
+   start_audio_thread();
 }
 
 void audio_cleanup(void)
 {
-   free(areas[0].addr);
-   free(areas);
-   snd_pcm_close(pcm);
+   /* the backend can't close under a period being committed,
+      unless we are exiting from the audio thread itself */
+   if (!pthread_equal(pthread_self(), audio_thrid)) {
+      __atomic_store_n(&quit, 1, __ATOMIC_RELEASE);
+      audio_wakeup();
+      pthread_join(audio_thrid, NULL);
+   }
+   if (verbose)
+      audio_print_stats(stderr);
+   backend->close();
+   free(mix);
+   free(conv);
+   if (wakeup_fd >= 0)
+      close(wakeup_fd);
 }
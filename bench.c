@@ -0,0 +1,232 @@
+/*
+ *  bench.c  render benchmark of Piano.
+ *
+ *  Copyright (C) 2008 Tigran Aivazian <tigran@bibles.org.uk>
+ *
+ *  Runs the audio thread's per-period work headless: mix the voices into
+ *  the bus, convert every channel to the output format and interleave it,
+ *  for a sweep of engines, rates, channel counts, period sizes and voice
+ *  counts.  Voices that die away are replaced by new notes, so every point
+ *  is measured at the polyphony it claims.
+ *
+ *  The results are CSV on stdout, one "point" line per measurement and one
+ *  "fit" line per period size giving the most voices whose average period
+ *  renders in less time than it plays for, so runs of two builds can be
+ *  compared line by line.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "piano.h"
+
+static const char *const bench_engines[] = { "wavetable", "sine", "waveguide", "additive", "sample" };
+static const unsigned int bench_rates[] = { MINRATE, 22050, 44100, 48000, MAXRATE };
+static const unsigned int bench_channels[] = { 1, 2, 8 };
+static const unsigned int bench_periods[] = { 64, 256, 1024 };
+
+#define NELEMS(a) (sizeof(a)/sizeof((a)[0]))
+
+static double seconds = 0.25; /* of audio rendered per point */
+static char *only_engine;
+static unsigned int only_rate, only_channels, only_period;
+static int have_samples;
+
+static void usage(void)
+{
+   fprintf(stderr,
+"Usage: piano-bench [options]...\n"
+"-e,--engine     only this engine (wavetable, sine, waveguide, additive, sample)\n"
+"-r,--rate       only this rate in Hz (%i...%i)\n"
+"-c,--channels   only this number of channels (%i...%i)\n"
+"-p,--period     only this period size in frames\n"
+"-f,--format     sample format (float, s32, s24_3, s16), s16 by default\n"
+"-s,--samples    directory of sample files, to include the sample engine\n"
+"-z,--compress   keep the samples compressed in memory\n"
+"-t,--time       seconds of audio rendered for every point\n"
+"\n", MINRATE, MAXRATE, MINCHANNELS, MAXCHANNELS);
+   exit(1);
+}
+
+/* keep n voices sounding, spread over the keyboard */
+static void top_up(int n, int *next)
+{
+   while (voices_active() < n) {
+      voice_on(MINMIDINOTE + *next % NKEYS, 100);
+      *next += 37; /* coprime with NKEYS, so every key comes round */
+   }
+}
+
+/* render 'periods' periods of 'period' frames with n voices, return the ns taken */
+static unsigned long long bench_point(int n, unsigned long periods, unsigned int period, enum sample_format format,
+                                      float *mix, void *conv, void *out, unsigned long long *worst)
+{
+   unsigned int channels = get_channels(), bytes = format_bits[format] / 8, chn;
+   unsigned long long t0, t1, total = 0;
+   unsigned long i;
+   void *in[MAXCHANNELS];
+   struct dither dither;
+   int next = 0;
+
+   voices_init();
+   dither_init(&dither);
+   for (chn = 0; chn < channels; chn++)
+      in[chn] = (unsigned char *)conv + chn * period * bytes;
+   *worst = 0;
+
+   for (i = 0; i < periods; i++) {
+      top_up(n, &next);
+      t0 = now_ns();
+      voices_render(mix, period, period);
+      for (chn = 0; chn < channels; chn++)
+         convert(format, in[chn], mix + chn * period, period, &dither);
+      kernels.interleave(out, in, channels, period, bytes);
+      t1 = now_ns();
+      total += t1 - t0;
+      if (t1 - t0 > *worst)
+         *worst = t1 - t0;
+   }
+   return total;
+}
+
+static void bench_config(const char *engine, unsigned int period, enum sample_format format)
+{
+   unsigned int rate = get_rate(), channels = get_channels();
+   unsigned long periods = seconds * rate / period, frames;
+   unsigned long long ns, worst, period_ns = (unsigned long long)period * 1000000000ULL / rate;
+   int n, fit = 0;
+   float *mix;
+   void *conv, *out;
+
+   if (periods < 1)
+      periods = 1;
+   frames = periods * period;
+   mix = malloc(channels * period * sizeof(float));
+   conv = malloc(channels * period * format_bits[format] / 8);
+   out = malloc(channels * period * format_bits[format] / 8);
+   if (!mix || !conv || !out) {
+      fprintf(stderr, "%s: Can't malloc memory for the mix\n", __func__);
+      exit(1);
+   }
+
+   for (n = 1; n <= POLYPHONY; n = (n < POLYPHONY && 2 * n > POLYPHONY) ? POLYPHONY : 2 * n) {
+      ns = bench_point(n, periods, period, format, mix, conv, out, &worst);
+      printf("point,%s,%s,%u,%u,%u,%d,%.2f,%.2f,%llu\n", engine, format_names[format],
+         rate, channels, period, n, (double)ns / frames, (double)frames / rate * 1e9 / ns, worst);
+      if (ns / periods < period_ns)
+         fit = n;
+      fflush(stdout);
+   }
+   printf("fit,%s,%s,%u,%u,%u,%d\n", engine, format_names[format], rate, channels, period, fit);
+
+   free(mix);
+   free(conv);
+   free(out);
+}
+
+static void parse_cmdline(int argc, char *argv[])
+{
+   struct option long_option[] =
+   {
+      {"engine", 1, NULL, 'e'},
+      {"rate", 1, NULL, 'r'},
+      {"channels", 1, NULL, 'c'},
+      {"period", 1, NULL, 'p'},
+      {"format", 1, NULL, 'f'},
+      {"samples", 1, NULL, 's'},
+      {"compress", 0, NULL, 'z'},
+      {"time", 1, NULL, 't'},
+      {NULL, 0, NULL, 0},
+   };
+
+   while (1) {
+      int c;
+      if ((c = getopt_long(argc, argv, "e:r:c:p:f:s:zt:", long_option, NULL)) < 0) break;
+      switch (c) {
+         case 'e':
+            set_engine(optarg); /* checks the name */
+            only_engine = optarg;
+            break;
+         case 'r':
+            only_rate = atoi(optarg);
+            set_rate(only_rate);
+            break;
+         case 'c':
+            only_channels = atoi(optarg);
+            set_channels(only_channels);
+            break;
+         case 'p':
+            only_period = atoi(optarg);
+            if (only_period < 1) {
+               fprintf(stderr, "piano: invalid period = %u, must be at least 1 frame\n", only_period);
+               exit(1);
+            }
+            break;
+         case 'f':
+            set_format(optarg);
+            break;
+         case 's':
+            set_sample_dir(optarg);
+            have_samples = 1;
+            break;
+         case 'z':
+            set_pack_mode();
+            break;
+         case 't':
+            seconds = atof(optarg);
+            if (seconds <= 0)
+               usage();
+            break;
+         default:
+            usage();
+      }
+   }
+}
+
+int main(int argc, char *argv[])
+{
+   enum sample_format format;
+   unsigned int e, r, c, p;
+
+   parse_cmdline(argc, argv);
+   if (only_engine && !strcmp(only_engine, "sample") && !have_samples) {
+      fprintf(stderr, "piano-bench: the sample engine needs a sample directory: -s DIR\n");
+      usage();
+   }
+   format = get_format();
+   if (format == FMT_AUTO)
+      format = FMT_S16;
+   kernels_init();
+   fprintf(stderr, "Render kernels: %s\n", kernels.name);
+   printf("# point,engine,format,rate,channels,period,voices,ns_per_frame,realtime,worst_period_ns\n");
+   printf("# fit,engine,format,rate,channels,period,max_voices\n");
+
+   for (r = 0; r < NELEMS(bench_rates); r++) {
+      if (only_rate && r)
+         break;
+      set_rate(only_rate ? only_rate : bench_rates[r]);
+      scales_init();
+      wavetable_init(get_rate());
+      if (have_samples)
+         samples_init();
+      for (e = 0; e < NELEMS(bench_engines); e++) {
+         if (only_engine ? strcmp(bench_engines[e], only_engine) : !strcmp(bench_engines[e], "sample") && !have_samples)
+            continue;
+         set_engine((char *)bench_engines[e]);
+         for (c = 0; c < NELEMS(bench_channels); c++) {
+            if (only_channels && c)
+               break;
+            set_channels(only_channels ? only_channels : bench_channels[c]);
+            for (p = 0; p < NELEMS(bench_periods); p++) {
+               if (only_period && p)
+                  break;
+               bench_config(bench_engines[e], only_period ? only_period : bench_periods[p], format);
+            }
+         }
+      }
+      if (have_samples)
+         samples_cleanup();
+   }
+   return 0;
+}
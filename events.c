@@ -0,0 +1,60 @@
+/*
+ *  events.c  lock-free note event queue of Piano.
+ *
+ *  Copyright (C) 2008 Tigran Aivazian <tigran@bibles.org.uk>
+ *
+ *  The MIDI thread is the only producer and the audio thread the only
+ *  consumer, so a ring with one index owned by each side is enough:
+ *  the producer publishes 'head' with release semantics after writing
+ *  the slot, the consumer publishes 'tail' after reading it.
+ */
+
+#include <time.h>
+#include "piano.h"
+
+#define EVENT_QUEUE_SIZE 1024 /* must be a power of two */
+
+static struct note_event queue[EVENT_QUEUE_SIZE];
+static unsigned int head; /* next slot to write, owned by the producer */
+static unsigned int tail; /* next slot to read, owned by the consumer */
+
+/* monotonic time in nanoseconds, used to timestamp events */
+unsigned long long now_ns(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* called by the producer only, returns 0 if the queue is full */
+int event_push(const struct note_event *ev)
+{
+   unsigned int h = __atomic_load_n(&head, __ATOMIC_RELAXED);
+   unsigned int t = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+
+   if (h - t == EVENT_QUEUE_SIZE)
+      return 0;
+   queue[h & (EVENT_QUEUE_SIZE - 1)] = *ev;
+   __atomic_store_n(&head, h + 1, __ATOMIC_RELEASE);
+   return 1;
+}
+
+/* called by the consumer only, returns the oldest event or NULL if empty */
+struct note_event *event_peek(void)
+{
+   unsigned int t = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+   unsigned int h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+
+   if (h == t)
+      return NULL;
+   return &queue[t & (EVENT_QUEUE_SIZE - 1)];
+}
+
+/* called by the consumer only, releases the slot returned by event_peek() */
+void event_pop(void)
+{
+   unsigned int t = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+
+   __atomic_store_n(&tail, t + 1, __ATOMIC_RELEASE);
+}
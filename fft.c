@@ -0,0 +1,138 @@
+/*
+ *  fft.c  real FFT of Piano.
+ *
+ *  Copyright (C) 2008 Tigran Aivazian <tigran@bibles.org.uk>
+ *
+ *  A real signal of n frames goes through a complex FFT of n/2 points,
+ *  the even frames in the real parts and the odd ones in the imaginary
+ *  parts, and the spectra of the two halves are then pulled apart and
+ *  joined into the n/2 + 1 bins from DC to Nyquist.  Spectra are kept as
+ *  separate arrays of real and imaginary parts so that multiplying two of
+ *  them is a plain loop over floats.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "piano.h"
+
+static void *fft_alloc(size_t size)
+{
+   void *p = calloc(1, size);
+
+   if (!p) {
+      fprintf(stderr, "%s: Can't malloc memory for the FFT tables\n", __func__);
+      exit(1);
+   }
+   return p;
+}
+
+void fft_init(struct fft *f, int n)
+{
+   int m = n / 2, bits = 0, i, j, k;
+
+   f->n = n;
+   f->rev = fft_alloc(m * sizeof(int));
+   f->wr = fft_alloc(m / 2 * sizeof(float) + sizeof(float));
+   f->wi = fft_alloc(m / 2 * sizeof(float) + sizeof(float));
+   f->tr = fft_alloc((m + 1) * sizeof(float));
+   f->ti = fft_alloc((m + 1) * sizeof(float));
+   f->zr = fft_alloc(m * sizeof(float));
+   f->zi = fft_alloc(m * sizeof(float));
+
+   while ((1 << bits) < m)
+      bits++;
+   for (i = 0; i < m; i++) {
+      for (j = 0, k = 0; k < bits; k++)
+         j |= ((i >> k) & 1) << (bits - 1 - k);
+      f->rev[i] = j;
+   }
+   for (k = 0; k < m / 2; k++) {
+      f->wr[k] = cos(2 * M_PI * k / m);
+      f->wi[k] = -sin(2 * M_PI * k / m);
+   }
+   for (k = 0; k <= m; k++) {
+      f->tr[k] = cos(2 * M_PI * k / n);
+      f->ti[k] = -sin(2 * M_PI * k / n);
+   }
+}
+
+/* in place radix-2 forward transform of n/2 complex points */
+static void fft_complex(const struct fft *f, float *re, float *im)
+{
+   int m = f->n / 2, size, half, step, i, j, k;
+   float t, tr, ti, wr, wi;
+
+   for (i = 0; i < m; i++) {
+      j = f->rev[i];
+      if (j > i) {
+         t = re[i]; re[i] = re[j]; re[j] = t;
+         t = im[i]; im[i] = im[j]; im[j] = t;
+      }
+   }
+   for (size = 2; size <= m; size *= 2) {
+      half = size / 2;
+      step = m / size;
+      for (i = 0; i < m; i += size)
+         for (k = 0; k < half; k++) {
+            wr = f->wr[k * step];
+            wi = f->wi[k * step];
+            j = i + k + half;
+            tr = re[j] * wr - im[j] * wi;
+            ti = re[j] * wi + im[j] * wr;
+            re[j] = re[i + k] - tr;
+            im[j] = im[i + k] - ti;
+            re[i + k] += tr;
+            im[i + k] += ti;
+         }
+   }
+}
+
+/* the n/2 + 1 bins of the spectrum of n real frames */
+void fft_forward(const struct fft *f, const float *in, float *re, float *im)
+{
+   int m = f->n / 2, k, a, b;
+   float er, ei, or, oi;
+
+   for (k = 0; k < m; k++) {
+      f->zr[k] = in[2 * k];
+      f->zi[k] = in[2 * k + 1];
+   }
+   fft_complex(f, f->zr, f->zi);
+
+   /* even = (Z[k] + Z*[m-k]) / 2, odd = (Z[k] - Z*[m-k]) / 2i */
+   for (k = 0; k <= m; k++) {
+      a = k % m;
+      b = (m - k) % m;
+      er = (f->zr[a] + f->zr[b]) / 2;
+      ei = (f->zi[a] - f->zi[b]) / 2;
+      or = (f->zi[a] + f->zi[b]) / 2;
+      oi = (f->zr[b] - f->zr[a]) / 2;
+      re[k] = er + or * f->tr[k] - oi * f->ti[k];
+      im[k] = ei + or * f->ti[k] + oi * f->tr[k];
+   }
+}
+
+/* the n real frames of a spectrum of n/2 + 1 bins, scaled back by 1/n */
+void fft_inverse(const struct fft *f, const float *re, const float *im, float *out)
+{
+   int m = f->n / 2, k;
+   float er, ei, dr, di, or, oi;
+
+   /* undo the split, conjugated so the forward transform runs it backwards */
+   for (k = 0; k < m; k++) {
+      er = (re[k] + re[m - k]) / 2;
+      ei = (im[k] - im[m - k]) / 2;
+      dr = (re[k] - re[m - k]) / 2;
+      di = (im[k] + im[m - k]) / 2;
+      or = dr * f->tr[k] + di * f->ti[k];
+      oi = di * f->tr[k] - dr * f->ti[k];
+      f->zr[k] = er - oi;
+      f->zi[k] = -(ei + or);
+   }
+   fft_complex(f, f->zr, f->zi);
+   for (k = 0; k < m; k++) {
+      out[2 * k] = f->zr[k] / m;
+      out[2 * k + 1] = -f->zi[k] / m;
+   }
+}
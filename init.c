@@ -20,16 +20,39 @@ static void usage(void)
 "Usage: piano [options]...\n"
 "-h,--help       help\n"
 "-d,--device     audio playback device\n"
+"-o,--output     where the audio goes: alsa (default), null, clock or file:PATH\n"
 "-r,--rate       stream rate in Hz (%i...%i)\n"
 "-c,--channels   number of audio channels in stream (%i...%i)\n"
 "-b,--buffer     ring buffer time in microseconds (%i...%i)\n"
 "-p,--period     period time in microseconds (%i...%i)\n"
+"-f,--format     sample format (float, s32, s24_3, s16), the best the device takes by default\n"
 "-R,--resample   enable software resampling\n"
+"-P,--priority   run the audio thread SCHED_FIFO at this priority (%i...%i)\n"
+"-C,--cpu        pin the audio thread to this CPU\n"
+"-L,--mlock      lock the audio thread's buffers, voices and stack in memory\n"
+"-I,--impulse    convolve the output with the impulse response in this WAV file,\n"
+"                needs periods of at least %i frames\n"
+"-E,--envelope   attack:decay:sustain:release in ms, ms, %% and ms (2:10000:0:250),\n"
+"                decay and release to -60dB, times within (%i...%i)\n"
+"-w,--spread     how far across the channels the keyboard spreads in percent (%i...%i)\n"
+"-t,--tuning     et (default), werckmeister, meantone, railsback or a Scala .scl file\n"
+"-e,--engine     synthesis engine (wavetable, sine, sample, waveguide, additive)\n"
+"-s,--samples    directory of <MIDI note>[_<velocity>[_<slot>]].wav files for the sample\n"
+"                engine, velocity the loudest a layer plays, slots taken in turn\n"
+"-S,--stream     stream samples from disk, keeping only their heads in memory\n"
+"-H,--head       resident head of streamed samples in milliseconds (%i...%i)\n"
+"-z,--compress   keep samples losslessly compressed in memory\n"
+"-M,--map        play samples from their files, paged in on demand, instead of\n"
+"                copying them into one huge page arena at startup\n"
 "-m,--midichan   restrict MIDI input to a channel (1...16)\n"
+"-i,--input      connect MIDI input from client:port, may be repeated (default 14:0)\n"
 "-N,--noshell    disable piano shell\n"
+"-W,--render     render a MIDI file to a WAV file and exit: -W in.mid out.wav\n"
+"-j,--jobs       threads for --render (%i...%i), one per CPU by default\n"
 "-v,--verbose    be verbose\n"
 "\n", MINRATE, MAXRATE, MINCHANNELS, MAXCHANNELS,
-MINBUFFERTIME, MAXBUFFERTIME, MINPERIODTIME, MAXPERIODTIME);
+MINBUFFERTIME, MAXBUFFERTIME, MINPERIODTIME, MAXPERIODTIME, MINRTPRIO, MAXRTPRIO, REVERB_MINBLOCK,
+MINENVTIME, MAXENVTIME, MINSPREAD, MAXSPREAD, MINHEADTIME, MAXHEADTIME, MINJOBS, MAXJOBS);
 
    exit(1);
 }
@@ -41,6 +64,8 @@ static void cleanup(void)
 
    audio_cleanup();
    midi_cleanup();
+   streams_cleanup();
+   samples_cleanup();
 
    /* readline changes the terminal state so we need
       to restore it before exiting the program */
@@ -53,6 +78,7 @@ static void parse_cmdline(int argc, char *argv[])
    {
       {"help", 0, NULL, 'h'},
       {"device", 1, NULL, 'd'},
+      {"output", 1, NULL, 'o'},
       {"rate", 1, NULL, 'r'},
       {"channels", 1, NULL, 'c'},
       {"buffer", 1, NULL, 'b'},
@@ -61,18 +87,37 @@ static void parse_cmdline(int argc, char *argv[])
       {"verbose", 1, NULL, 'v'},
       {"resample", 1, NULL, 'R'},
       {"noshell", 1, NULL, 'N'},
+      {"envelope", 1, NULL, 'E'},
+      {"spread", 1, NULL, 'w'},
+      {"impulse", 1, NULL, 'I'},
+      {"tuning", 1, NULL, 't'},
+      {"engine", 1, NULL, 'e'},
+      {"samples", 1, NULL, 's'},
+      {"stream", 0, NULL, 'S'},
+      {"head", 1, NULL, 'H'},
+      {"compress", 0, NULL, 'z'},
+      {"map", 0, NULL, 'M'},
+      {"render", 1, NULL, 'W'},
+      {"jobs", 1, NULL, 'j'},
+      {"input", 1, NULL, 'i'},
+      {"priority", 1, NULL, 'P'},
+      {"cpu", 1, NULL, 'C'},
+      {"mlock", 0, NULL, 'L'},
       {NULL, 0, NULL, 0},
    };
 
    while (1) {
       int c;
-      if ((c = getopt_long(argc, argv, "hd:r:c:b:p:vRm:N", long_option, NULL)) < 0) break;
+      if ((c = getopt_long(argc, argv, "hd:o:r:c:b:p:f:vRm:NE:w:I:t:e:s:SH:zMW:j:P:C:Li:", long_option, NULL)) < 0) break;
       switch (c) {
          case 'h':
             usage();
          case 'd':
             set_pcm_devname(optarg);
             break;
+         case 'o':
+            set_backend(optarg);
+            break;
          case 'r':
             set_rate(atoi(optarg));
             break;
@@ -85,6 +130,9 @@ static void parse_cmdline(int argc, char *argv[])
          case 'p':
             set_period_time(atoi(optarg));
             break;
+         case 'f':
+            set_format(optarg);
+            break;
          case 'v':
             verbose = 1;
             break;
@@ -94,13 +142,63 @@ static void parse_cmdline(int argc, char *argv[])
          case 'm':
             set_midichan(atoi(optarg));
             break;
+         case 'i':
+            set_midi_source(optarg);
+            break;
          case 'N':
             noshell = 1;
             break;
+         case 'E':
+            set_envelope(optarg);
+            break;
+         case 'w':
+            set_spread(atoi(optarg));
+            break;
+         case 'I':
+            set_impulse(optarg);
+            break;
+         case 't':
+            set_tuning(optarg);
+            break;
+         case 'e':
+            set_engine(optarg);
+            break;
+         case 's':
+            set_sample_dir(optarg);
+            break;
+         case 'S':
+            set_stream_mode();
+            break;
+         case 'H':
+            set_head_time(atoi(optarg));
+            break;
+         case 'z':
+            set_pack_mode();
+            break;
+         case 'M':
+            set_map_mode();
+            break;
+         case 'W':
+            set_render(optarg);
+            break;
+         case 'j':
+            set_jobs(atoi(optarg));
+            break;
+         case 'P':
+            set_rt_priority(atoi(optarg));
+            break;
+         case 'C':
+            set_audio_cpu(atoi(optarg));
+            break;
+         case 'L':
+            set_lock_memory();
+            break;
          default:
             usage();
       }
    }
+   if (render_pending() && optind < argc)
+      set_render_output(argv[optind]);
 }
 
 void init(int argc, char *argv[])
@@ -113,6 +211,17 @@ void init(int argc, char *argv[])
    parse_cmdline(argc, argv); 
    signals_init();
    scales_init();
+   kernels_init();
+   voices_init();
+   samples_init();
+   streams_init();
+   if (render_pending()) {
+      wavetable_init(get_rate());
+      render();
+      streams_cleanup();
+      samples_cleanup();
+      exit(0);
+   }
    audio_init();
    midi_init();
    if (!noshell)
@@ -0,0 +1,944 @@
+/*
+ *  kernels.c  vectorised render kernels of Piano.
+ *
+ *  Copyright (C) 2008 Tigran Aivazian <tigran@bibles.org.uk>
+ *
+ *  Every kernel has a portable scalar version and, on x86, SSE2 and AVX2
+ *  versions compiled with per-function target attributes, so the binary
+ *  still runs on any CPU.  kernels_init() picks the best set at startup.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "piano.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+struct kernels kernels; /* the active kernel set */
+
+static const double max_phase = 2.0 * M_PI;
+
+/* Taylor coefficients of sin(x), accurate to 6e-8 on [-pi/2, pi/2] */
+#define S3  (-1.6666666666666666e-1f)
+#define S5  ( 8.3333333333333333e-3f)
+#define S7  (-1.9841269841269841e-4f)
+#define S9  ( 2.7557319223985891e-6f)
+#define S11 (-2.5052108385441719e-8f)
+
+/* scalar versions */
+
+static void sine_scalar(float *out, int count, double *_phase, double step, float amp)
+{
+   double phase = *_phase;
+   int n;
+
+   for (n = 0; n < count; n++) {
+      out[n] += amp * sin(phase);
+      phase += step;
+      if (phase >= max_phase)
+         phase -= max_phase;
+   }
+   *_phase = phase;
+}
+
+/* full scale of each integer format, clamped inputs never round past it */
+#define S16_SCALE 32767.0f
+#define S24_SCALE 8388607.0f
+#define S32_SCALE 2147483648.0f
+#define S32_MAX   2147483520.0f /* the largest float below 2^31 */
+
+static inline float clamp(float x)
+{
+   return (x > 1.0f) ? 1.0f : (x < -1.0f) ? -1.0f : x;
+}
+
+static inline unsigned int xorshift(unsigned int x)
+{
+   x ^= x << 13;
+   x ^= x >> 17;
+   x ^= x << 5;
+   return x;
+}
+
+/* a float in [1, 2) from the top bits of x */
+static inline float uniform(unsigned int x)
+{
+   union { unsigned int i; float f; } u;
+
+   u.i = x >> 9 | 0x3f800000;
+   return u.f;
+}
+
+/*
+ * Every lane of the dither generator is a separate xorshift and sample n
+ * always draws from lane n % DITHER_LANES, so all kernel sets produce
+ * the same noise and therefore the same output.
+ */
+void dither_init(struct dither *d)
+{
+   int i;
+
+   for (i = 0; i < DITHER_LANES; i++)
+      d->s[i] = 0x9e3779b9u * (i + 1);
+}
+
+/* TPDF dither: the difference of two uniform values, +-1 LSB at most */
+static inline float tpdf(struct dither *d, int lane)
+{
+   float a;
+
+   d->s[lane] = xorshift(d->s[lane]);
+   a = uniform(d->s[lane]);
+   d->s[lane] = xorshift(d->s[lane]);
+   return a - uniform(d->s[lane]);
+}
+
+static void to_float_scalar(float *out, const float *in, int count)
+{
+   int n;
+
+   for (n = 0; n < count; n++)
+      out[n] = clamp(in[n]);
+}
+
+static void to_s32_scalar(int *out, const float *in, int count)
+{
+   float x;
+   int n;
+
+   for (n = 0; n < count; n++) {
+      x = clamp(in[n]) * S32_SCALE;
+      out[n] = lrintf((x > S32_MAX) ? S32_MAX : x);
+   }
+}
+
+static void to_s24_3_scalar(unsigned char *out, const float *in, int count)
+{
+   long res;
+   int n;
+
+   for (n = 0; n < count; n++) {
+      res = lrintf(clamp(in[n]) * S24_SCALE);
+      *out++ = res;
+      *out++ = res >> 8;
+      *out++ = res >> 16;
+   }
+}
+
+static void to_s16_scalar(short *out, const float *in, int count, struct dither *d)
+{
+   int n;
+   long res;
+
+   for (n = 0; n < count; n++) {
+      res = lrintf(clamp(in[n]) * S16_SCALE + tpdf(d, n % DITHER_LANES));
+      if (res > 32767)
+         res = 32767;
+      else if (res < -32768)
+         res = -32768;
+      out[n] = res;
+   }
+}
+
+static void interleave_scalar(void *_out, void *const *in, int channels, int count, int bytes)
+{
+   unsigned char *out = _out;
+   int n, chn;
+
+   if (channels == 1) {
+      memcpy(out, in[0], count * bytes);
+      return;
+   }
+   switch (bytes) {
+      case 2:
+         for (n = 0; n < count; n++)
+            for (chn = 0; chn < channels; chn++, out += 2)
+               *(short *)out = ((const short *)in[chn])[n];
+         break;
+      case 4:
+         for (n = 0; n < count; n++)
+            for (chn = 0; chn < channels; chn++, out += 4)
+               *(int *)out = ((const int *)in[chn])[n];
+         break;
+      default:
+         for (n = 0; n < count; n++)
+            for (chn = 0; chn < channels; chn++, out += bytes)
+               memcpy(out, (const unsigned char *)in[chn] + n * bytes, bytes);
+   }
+}
+
+/* whether a channel gets nothing from these n gains, as most of a big rig don't */
+static inline int silent(const float *from, const float *to, int n)
+{
+   int i;
+
+   for (i = 0; i < n; i++)
+      if (from[i] != 0 || to[i] != 0)
+         return 0;
+   return 1;
+}
+
+/* frame n gets gain from + (to - from) * (n + 1) / count, reaching 'to' at the end */
+static void pan_scalar(float *bus, int stride, int channels, const float *in, int count,
+                       const float *from, const float *to)
+{
+   float d;
+   int c, n;
+
+   for (c = 0; c < channels; c++, bus += stride) {
+      if (silent(from + c, to + c, 1))
+         continue;
+      d = (to[c] - from[c]) / count;
+      for (n = 0; n < count; n++)
+         bus[n] += (from[c] + d * (n + 1)) * in[n];
+   }
+}
+
+static void pan_lanes_scalar(float *bus, int stride, int channels, const float *in, int count,
+                             const float *from, const float *to)
+{
+   float d[WG_LANES], sum;
+   int c, n, i;
+
+   for (c = 0; c < channels; c++, bus += stride, from += WG_LANES, to += WG_LANES) {
+      if (silent(from, to, WG_LANES))
+         continue;
+      for (i = 0; i < WG_LANES; i++)
+         d[i] = (to[i] - from[i]) / count;
+      for (n = 0; n < count; n++) {
+         sum = 0;
+         for (i = 0; i < WG_LANES; i++)
+            sum += (from[i] + d[i] * (n + 1)) * in[n * WG_LANES + i];
+         bus[n] += sum;
+      }
+   }
+}
+
+static float dot_scalar(const float *a, const float *b, int count)
+{
+   float sum = 0;
+   int n;
+
+   for (n = 0; n < count; n++)
+      sum += a[n] * b[n];
+   return sum;
+}
+
+static void cmac_scalar(float *yr, float *yi, const float *ar, const float *ai,
+                        const float *br, const float *bi, int count)
+{
+   int n;
+
+   for (n = 0; n < count; n++) {
+      yr[n] += ar[n] * br[n] - ai[n] * bi[n];
+      yi[n] += ar[n] * bi[n] + ai[n] * br[n];
+   }
+}
+
+/* one frame of every lane: tune, lose, disperse, write back into the line */
+static void waveguide_scalar(struct wg_lanes *l, float *out, int count)
+{
+   float x, y;
+   int n, i;
+
+   for (n = 0; n < count; n++) {
+      for (i = 0; i < WG_LANES; i++) {
+         x = l->line[l->base[i] + ((l->pos[i] - l->length[i]) & WG_MASK)];
+         y = l->tune[i] * (x - l->tune_y[i]) + l->tune_x[i];
+         l->tune_x[i] = x;
+         l->tune_y[i] = y;
+         y = l->loss_gain[i] * y + l->loss_pole[i] * l->loss_y[i];
+         l->loss_y[i] = y;
+         x = l->disp[i] * (y - l->disp_y[i]) + l->disp_x[i];
+         l->disp_x[i] = y;
+         l->disp_y[i] = x;
+         l->line[l->base[i] + (l->pos[i] & WG_MASK)] = x;
+         l->pos[i]++;
+         out[n * WG_LANES + i] = x;
+      }
+   }
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/* SSE2 versions */
+
+/* sin(x) for x of a few turns either way, four lanes at a time */
+__attribute__((target("sse2")))
+static inline __m128 sin_ps_sse2(__m128 x)
+{
+   const __m128 pi = _mm_set1_ps(M_PI), twopi = _mm_set1_ps(2.0 * M_PI);
+   __m128 k, x2, p;
+
+   /* reduce to [-pi, pi], then fold onto [-pi/2, pi/2] */
+   k = _mm_cvtepi32_ps(_mm_cvtps_epi32(_mm_mul_ps(x, _mm_set1_ps(0.5 / M_PI))));
+   x = _mm_sub_ps(x, _mm_mul_ps(k, twopi));
+   x = _mm_min_ps(x, _mm_sub_ps(pi, x));
+   x = _mm_max_ps(x, _mm_sub_ps(_mm_sub_ps(_mm_setzero_ps(), pi), x));
+
+   x2 = _mm_mul_ps(x, x);
+   p = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(S11), x2), _mm_set1_ps(S9));
+   p = _mm_add_ps(_mm_mul_ps(p, x2), _mm_set1_ps(S7));
+   p = _mm_add_ps(_mm_mul_ps(p, x2), _mm_set1_ps(S5));
+   p = _mm_add_ps(_mm_mul_ps(p, x2), _mm_set1_ps(S3));
+   return _mm_add_ps(x, _mm_mul_ps(_mm_mul_ps(p, x2), x));
+}
+
+__attribute__((target("sse2")))
+static void sine_sse2(float *out, int count, double *_phase, double step, float amp)
+{
+   double phase = *_phase;
+   const __m128 lanes = _mm_mul_ps(_mm_set_ps(3, 2, 1, 0), _mm_set1_ps(step));
+   const __m128 vamp = _mm_set1_ps(amp);
+   __m128 x;
+   int n;
+
+   for (n = 0; n + 4 <= count; n += 4) {
+      x = sin_ps_sse2(_mm_add_ps(_mm_set1_ps(phase), lanes));
+      _mm_storeu_ps(out + n, _mm_add_ps(_mm_loadu_ps(out + n), _mm_mul_ps(x, vamp)));
+      phase += 4 * step;
+      while (phase >= max_phase)
+         phase -= max_phase;
+   }
+   *_phase = phase;
+   sine_scalar(out + n, count - n, _phase, step, amp);
+}
+
+__attribute__((target("sse2")))
+static inline __m128 clamp_ps_sse2(__m128 x)
+{
+   return _mm_max_ps(_mm_min_ps(x, _mm_set1_ps(1.0f)), _mm_set1_ps(-1.0f));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i xorshift_sse2(__m128i x)
+{
+   x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+   x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+   return _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+}
+
+/* four lanes of tpdf() */
+__attribute__((target("sse2")))
+static inline __m128 tpdf_sse2(__m128i *s)
+{
+   const __m128i one = _mm_set1_epi32(0x3f800000);
+   __m128 a;
+
+   *s = xorshift_sse2(*s);
+   a = _mm_castsi128_ps(_mm_or_si128(_mm_srli_epi32(*s, 9), one));
+   *s = xorshift_sse2(*s);
+   return _mm_sub_ps(a, _mm_castsi128_ps(_mm_or_si128(_mm_srli_epi32(*s, 9), one)));
+}
+
+__attribute__((target("sse2")))
+static void to_float_sse2(float *out, const float *in, int count)
+{
+   int n;
+
+   for (n = 0; n + 4 <= count; n += 4)
+      _mm_storeu_ps(out + n, clamp_ps_sse2(_mm_loadu_ps(in + n)));
+   to_float_scalar(out + n, in + n, count - n);
+}
+
+__attribute__((target("sse2")))
+static void to_s32_sse2(int *out, const float *in, int count)
+{
+   const __m128 scale = _mm_set1_ps(S32_SCALE), max = _mm_set1_ps(S32_MAX);
+   __m128 a;
+   int n;
+
+   for (n = 0; n + 4 <= count; n += 4) {
+      a = _mm_min_ps(_mm_mul_ps(clamp_ps_sse2(_mm_loadu_ps(in + n)), scale), max);
+      _mm_storeu_si128((__m128i *)(out + n), _mm_cvtps_epi32(a));
+   }
+   to_s32_scalar(out + n, in + n, count - n);
+}
+
+/* SSE2 can't shuffle bytes, so only the conversion is vectorised */
+__attribute__((target("sse2")))
+static void to_s24_3_sse2(unsigned char *out, const float *in, int count)
+{
+   const __m128 scale = _mm_set1_ps(S24_SCALE);
+   int res[4] __attribute__((aligned(16)));
+   int n, i;
+
+   for (n = 0; n + 4 <= count; n += 4) {
+      _mm_store_si128((__m128i *)res,
+         _mm_cvtps_epi32(_mm_mul_ps(clamp_ps_sse2(_mm_loadu_ps(in + n)), scale)));
+      for (i = 0; i < 4; i++) {
+         *out++ = res[i];
+         *out++ = res[i] >> 8;
+         *out++ = res[i] >> 16;
+      }
+   }
+   to_s24_3_scalar(out, in + n, count - n);
+}
+
+__attribute__((target("sse2")))
+static void to_s16_sse2(short *out, const float *in, int count, struct dither *d)
+{
+   const __m128 scale = _mm_set1_ps(S16_SCALE);
+   __m128i s0 = _mm_loadu_si128((const __m128i *)d->s);
+   __m128i s1 = _mm_loadu_si128((const __m128i *)(d->s + 4));
+   __m128 a, b;
+   int n;
+
+   for (n = 0; n + 8 <= count; n += 8) {
+      /* clamp first, cvtps2dq turns out-of-range values into INT_MIN */
+      a = _mm_add_ps(_mm_mul_ps(clamp_ps_sse2(_mm_loadu_ps(in + n)), scale), tpdf_sse2(&s0));
+      b = _mm_add_ps(_mm_mul_ps(clamp_ps_sse2(_mm_loadu_ps(in + n + 4)), scale), tpdf_sse2(&s1));
+      _mm_storeu_si128((__m128i *)(out + n),
+         _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b)));
+   }
+   _mm_storeu_si128((__m128i *)d->s, s0);
+   _mm_storeu_si128((__m128i *)(d->s + 4), s1);
+   to_s16_scalar(out + n, in + n, count - n, d);
+}
+
+__attribute__((target("sse2")))
+static void interleave_sse2(void *_out, void *const *in, int channels, int count, int bytes)
+{
+   __m128i l, r;
+   int n;
+
+   if (channels == 2 && bytes == 2) {
+      short *out = _out;
+      const short *in0 = in[0], *in1 = in[1];
+
+      for (n = 0; n + 8 <= count; n += 8) {
+         l = _mm_loadu_si128((const __m128i *)(in0 + n));
+         r = _mm_loadu_si128((const __m128i *)(in1 + n));
+         _mm_storeu_si128((__m128i *)(out + 2 * n), _mm_unpacklo_epi16(l, r));
+         _mm_storeu_si128((__m128i *)(out + 2 * n + 8), _mm_unpackhi_epi16(l, r));
+      }
+      for (; n < count; n++) {
+         out[2 * n] = in0[n];
+         out[2 * n + 1] = in1[n];
+      }
+   } else if (channels == 2 && bytes == 4) {
+      int *out = _out;
+      const int *in0 = in[0], *in1 = in[1];
+
+      for (n = 0; n + 4 <= count; n += 4) {
+         l = _mm_loadu_si128((const __m128i *)(in0 + n));
+         r = _mm_loadu_si128((const __m128i *)(in1 + n));
+         _mm_storeu_si128((__m128i *)(out + 2 * n), _mm_unpacklo_epi32(l, r));
+         _mm_storeu_si128((__m128i *)(out + 2 * n + 4), _mm_unpackhi_epi32(l, r));
+      }
+      for (; n < count; n++) {
+         out[2 * n] = in0[n];
+         out[2 * n + 1] = in1[n];
+      }
+   } else
+      interleave_scalar(_out, in, channels, count, bytes);
+}
+
+__attribute__((target("sse2")))
+static void pan_sse2(float *bus, int stride, int channels, const float *in, int count,
+                     const float *from, const float *to)
+{
+   const __m128 four = _mm_set1_ps(4.0f);
+   __m128 f, d, k;
+   float dc;
+   int c, n;
+
+   for (c = 0; c < channels; c++, bus += stride) {
+      if (silent(from + c, to + c, 1))
+         continue;
+      dc = (to[c] - from[c]) / count;
+      f = _mm_set1_ps(from[c]);
+      d = _mm_set1_ps(dc);
+      k = _mm_setr_ps(1, 2, 3, 4); /* n + 1 of each frame */
+      for (n = 0; n + 4 <= count; n += 4) {
+         _mm_storeu_ps(bus + n, _mm_add_ps(_mm_loadu_ps(bus + n),
+            _mm_mul_ps(_mm_add_ps(f, _mm_mul_ps(d, k)), _mm_loadu_ps(in + n))));
+         k = _mm_add_ps(k, four);
+      }
+      for (; n < count; n++)
+         bus[n] += (from[c] + dc * (n + 1)) * in[n];
+   }
+}
+
+/* four frames at a time: the lane products of each, transposed and summed */
+__attribute__((target("sse2")))
+static void pan_lanes_sse2(float *bus, int stride, int channels, const float *in, int count,
+                           const float *from, const float *to)
+{
+   __m128 f0, f1, d0, d1, k, p[4];
+   const float *y;
+   float d[WG_LANES], sum;
+   int c, n, i, j;
+
+   for (c = 0; c < channels; c++, bus += stride, from += WG_LANES, to += WG_LANES) {
+      if (silent(from, to, WG_LANES))
+         continue;
+      for (i = 0; i < WG_LANES; i++)
+         d[i] = (to[i] - from[i]) / count;
+      f0 = _mm_loadu_ps(from);
+      f1 = _mm_loadu_ps(from + 4);
+      d0 = _mm_loadu_ps(d);
+      d1 = _mm_loadu_ps(d + 4);
+      for (n = 0; n + 4 <= count; n += 4) {
+         for (j = 0; j < 4; j++) {
+            k = _mm_set1_ps(n + j + 1);
+            y = in + (n + j) * WG_LANES;
+            p[j] = _mm_add_ps(_mm_mul_ps(_mm_add_ps(f0, _mm_mul_ps(d0, k)), _mm_load_ps(y)),
+                              _mm_mul_ps(_mm_add_ps(f1, _mm_mul_ps(d1, k)), _mm_load_ps(y + 4)));
+         }
+         _MM_TRANSPOSE4_PS(p[0], p[1], p[2], p[3]);
+         _mm_storeu_ps(bus + n, _mm_add_ps(_mm_loadu_ps(bus + n),
+            _mm_add_ps(_mm_add_ps(p[0], p[1]), _mm_add_ps(p[2], p[3]))));
+      }
+      for (; n < count; n++) {
+         sum = 0;
+         for (i = 0; i < WG_LANES; i++)
+            sum += (from[i] + d[i] * (n + 1)) * in[n * WG_LANES + i];
+         bus[n] += sum;
+      }
+   }
+}
+
+/* count must be a multiple of 8 */
+__attribute__((target("sse2")))
+static float dot_sse2(const float *a, const float *b, int count)
+{
+   __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+   float sum[4];
+   int n;
+
+   for (n = 0; n < count; n += 8) {
+      acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + n), _mm_loadu_ps(b + n)));
+      acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + n + 4), _mm_loadu_ps(b + n + 4)));
+   }
+   _mm_storeu_ps(sum, _mm_add_ps(acc0, acc1));
+   return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+}
+
+/* count must be a multiple of 8 */
+__attribute__((target("sse2")))
+static void cmac_sse2(float *yr, float *yi, const float *ar, const float *ai,
+                      const float *br, const float *bi, int count)
+{
+   __m128 a, b, c, d;
+   int n;
+
+   for (n = 0; n < count; n += 4) {
+      a = _mm_loadu_ps(ar + n);
+      b = _mm_loadu_ps(ai + n);
+      c = _mm_loadu_ps(br + n);
+      d = _mm_loadu_ps(bi + n);
+      _mm_storeu_ps(yr + n, _mm_add_ps(_mm_loadu_ps(yr + n), _mm_sub_ps(_mm_mul_ps(a, c), _mm_mul_ps(b, d))));
+      _mm_storeu_ps(yi + n, _mm_add_ps(_mm_loadu_ps(yi + n), _mm_add_ps(_mm_mul_ps(a, d), _mm_mul_ps(b, c))));
+   }
+}
+
+/* the lanes as two halves of four, SSE2 has no gather or scatter */
+__attribute__((target("sse2")))
+static void waveguide_sse2(struct wg_lanes *l, float *out, int count)
+{
+   const __m128i mask = _mm_set1_epi32(WG_MASK), one = _mm_set1_epi32(1);
+   __m128i base[2], pos[2], len[2];
+   __m128 tune[2], tx[2], ty[2], gain[2], pole[2], ly[2], disp[2], dx[2], dy[2];
+   __m128 x, y;
+   int rd[4] __attribute__((aligned(16))), wr[4] __attribute__((aligned(16)));
+   float *val;
+   int n, h, i;
+
+   for (h = 0; h < 2; h++) {
+      base[h] = _mm_load_si128((const __m128i *)(l->base + 4 * h));
+      pos[h] = _mm_load_si128((const __m128i *)(l->pos + 4 * h));
+      len[h] = _mm_load_si128((const __m128i *)(l->length + 4 * h));
+      tune[h] = _mm_load_ps(l->tune + 4 * h);
+      tx[h] = _mm_load_ps(l->tune_x + 4 * h);
+      ty[h] = _mm_load_ps(l->tune_y + 4 * h);
+      gain[h] = _mm_load_ps(l->loss_gain + 4 * h);
+      pole[h] = _mm_load_ps(l->loss_pole + 4 * h);
+      ly[h] = _mm_load_ps(l->loss_y + 4 * h);
+      disp[h] = _mm_load_ps(l->disp + 4 * h);
+      dx[h] = _mm_load_ps(l->disp_x + 4 * h);
+      dy[h] = _mm_load_ps(l->disp_y + 4 * h);
+   }
+
+   for (n = 0; n < count; n++) {
+      for (h = 0; h < 2; h++) {
+         _mm_store_si128((__m128i *)rd, _mm_add_epi32(base[h],
+            _mm_and_si128(_mm_sub_epi32(pos[h], len[h]), mask)));
+         _mm_store_si128((__m128i *)wr, _mm_add_epi32(base[h], _mm_and_si128(pos[h], mask)));
+         x = _mm_set_ps(l->line[rd[3]], l->line[rd[2]], l->line[rd[1]], l->line[rd[0]]);
+         y = _mm_add_ps(_mm_mul_ps(tune[h], _mm_sub_ps(x, ty[h])), tx[h]);
+         tx[h] = x;
+         ty[h] = y;
+         y = _mm_add_ps(_mm_mul_ps(gain[h], y), _mm_mul_ps(pole[h], ly[h]));
+         ly[h] = y;
+         x = _mm_add_ps(_mm_mul_ps(disp[h], _mm_sub_ps(y, dy[h])), dx[h]);
+         dx[h] = y;
+         dy[h] = x;
+         val = out + n * WG_LANES + 4 * h;
+         _mm_store_ps(val, x);
+         for (i = 0; i < 4; i++)
+            l->line[wr[i]] = val[i];
+         pos[h] = _mm_add_epi32(pos[h], one);
+      }
+   }
+
+   for (h = 0; h < 2; h++) {
+      _mm_store_si128((__m128i *)(l->pos + 4 * h), pos[h]);
+      _mm_store_ps(l->tune_x + 4 * h, tx[h]);
+      _mm_store_ps(l->tune_y + 4 * h, ty[h]);
+      _mm_store_ps(l->loss_y + 4 * h, ly[h]);
+      _mm_store_ps(l->disp_x + 4 * h, dx[h]);
+      _mm_store_ps(l->disp_y + 4 * h, dy[h]);
+   }
+}
+
+/* AVX2 versions */
+
+__attribute__((target("avx2,fma")))
+static inline __m256 sin_ps_avx2(__m256 x)
+{
+   const __m256 pi = _mm256_set1_ps(M_PI), twopi = _mm256_set1_ps(2.0 * M_PI);
+   __m256 k, x2, p;
+
+   k = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(0.5 / M_PI)),
+                       _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+   x = _mm256_fnmadd_ps(k, twopi, x);
+   x = _mm256_min_ps(x, _mm256_sub_ps(pi, x));
+   x = _mm256_max_ps(x, _mm256_sub_ps(_mm256_sub_ps(_mm256_setzero_ps(), pi), x));
+
+   x2 = _mm256_mul_ps(x, x);
+   p = _mm256_fmadd_ps(_mm256_set1_ps(S11), x2, _mm256_set1_ps(S9));
+   p = _mm256_fmadd_ps(p, x2, _mm256_set1_ps(S7));
+   p = _mm256_fmadd_ps(p, x2, _mm256_set1_ps(S5));
+   p = _mm256_fmadd_ps(p, x2, _mm256_set1_ps(S3));
+   return _mm256_fmadd_ps(_mm256_mul_ps(p, x2), x, x);
+}
+
+__attribute__((target("avx2,fma")))
+static void sine_avx2(float *out, int count, double *_phase, double step, float amp)
+{
+   double phase = *_phase;
+   const __m256 lanes = _mm256_mul_ps(_mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0), _mm256_set1_ps(step));
+   const __m256 vamp = _mm256_set1_ps(amp);
+   __m256 x;
+   int n;
+
+   for (n = 0; n + 8 <= count; n += 8) {
+      x = sin_ps_avx2(_mm256_add_ps(_mm256_set1_ps(phase), lanes));
+      _mm256_storeu_ps(out + n, _mm256_fmadd_ps(x, vamp, _mm256_loadu_ps(out + n)));
+      phase += 8 * step;
+      while (phase >= max_phase)
+         phase -= max_phase;
+   }
+   *_phase = phase;
+   sine_scalar(out + n, count - n, _phase, step, amp);
+}
+
+__attribute__((target("avx2")))
+static inline __m256 clamp_ps_avx2(__m256 x)
+{
+   return _mm256_max_ps(_mm256_min_ps(x, _mm256_set1_ps(1.0f)), _mm256_set1_ps(-1.0f));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i xorshift_avx2(__m256i x)
+{
+   x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 13));
+   x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 17));
+   return _mm256_xor_si256(x, _mm256_slli_epi32(x, 5));
+}
+
+/* eight lanes of tpdf() */
+__attribute__((target("avx2")))
+static inline __m256 tpdf_avx2(__m256i *s)
+{
+   const __m256i one = _mm256_set1_epi32(0x3f800000);
+   __m256 a;
+
+   *s = xorshift_avx2(*s);
+   a = _mm256_castsi256_ps(_mm256_or_si256(_mm256_srli_epi32(*s, 9), one));
+   *s = xorshift_avx2(*s);
+   return _mm256_sub_ps(a, _mm256_castsi256_ps(_mm256_or_si256(_mm256_srli_epi32(*s, 9), one)));
+}
+
+__attribute__((target("avx2")))
+static void to_float_avx2(float *out, const float *in, int count)
+{
+   int n;
+
+   for (n = 0; n + 8 <= count; n += 8)
+      _mm256_storeu_ps(out + n, clamp_ps_avx2(_mm256_loadu_ps(in + n)));
+   to_float_sse2(out + n, in + n, count - n);
+}
+
+__attribute__((target("avx2")))
+static void to_s32_avx2(int *out, const float *in, int count)
+{
+   const __m256 scale = _mm256_set1_ps(S32_SCALE), max = _mm256_set1_ps(S32_MAX);
+   __m256 a;
+   int n;
+
+   for (n = 0; n + 8 <= count; n += 8) {
+      a = _mm256_min_ps(_mm256_mul_ps(clamp_ps_avx2(_mm256_loadu_ps(in + n)), scale), max);
+      _mm256_storeu_si256((__m256i *)(out + n), _mm256_cvtps_epi32(a));
+   }
+   to_s32_sse2(out + n, in + n, count - n);
+}
+
+__attribute__((target("avx2")))
+static void to_s24_3_avx2(unsigned char *out, const float *in, int count)
+{
+   const __m256 scale = _mm256_set1_ps(S24_SCALE);
+   /* the low three bytes of each 32-bit sample, packed to the front of each half */
+   const __m256i pack = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                         0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+   __m256i res;
+   int n;
+
+   /* each half is stored 16 bytes wide, the 4 spare bytes past the end of
+      the second are overwritten by the next round or left to spare */
+   for (n = 0; n + 10 <= count; n += 8) {
+      res = _mm256_cvtps_epi32(_mm256_mul_ps(clamp_ps_avx2(_mm256_loadu_ps(in + n)), scale));
+      res = _mm256_shuffle_epi8(res, pack);
+      _mm_storeu_si128((__m128i *)(out + 3 * n), _mm256_castsi256_si128(res));
+      _mm_storeu_si128((__m128i *)(out + 3 * n + 12), _mm256_extracti128_si256(res, 1));
+   }
+   to_s24_3_sse2(out + 3 * n, in + n, count - n);
+}
+
+__attribute__((target("avx2")))
+static void to_s16_avx2(short *out, const float *in, int count, struct dither *d)
+{
+   const __m256 scale = _mm256_set1_ps(S16_SCALE);
+   __m256i s = _mm256_loadu_si256((const __m256i *)d->s);
+   __m256 a, b;
+   __m256i packed;
+   int n;
+
+   for (n = 0; n + 16 <= count; n += 16) {
+      a = _mm256_add_ps(_mm256_mul_ps(clamp_ps_avx2(_mm256_loadu_ps(in + n)), scale), tpdf_avx2(&s));
+      b = _mm256_add_ps(_mm256_mul_ps(clamp_ps_avx2(_mm256_loadu_ps(in + n + 8)), scale), tpdf_avx2(&s));
+      /* packs works within 128-bit lanes, so put the quadwords back in order */
+      packed = _mm256_packs_epi32(_mm256_cvtps_epi32(a), _mm256_cvtps_epi32(b));
+      _mm256_storeu_si256((__m256i *)(out + n), _mm256_permute4x64_epi64(packed, 0xd8));
+   }
+   _mm256_storeu_si256((__m256i *)d->s, s);
+   to_s16_sse2(out + n, in + n, count - n, d);
+}
+
+__attribute__((target("avx2")))
+static void pan_avx2(float *bus, int stride, int channels, const float *in, int count,
+                     const float *from, const float *to)
+{
+   const __m256 eight = _mm256_set1_ps(8.0f);
+   __m256 f, d, k;
+   float dc;
+   int c, n;
+
+   for (c = 0; c < channels; c++, bus += stride) {
+      if (silent(from + c, to + c, 1))
+         continue;
+      dc = (to[c] - from[c]) / count;
+      f = _mm256_set1_ps(from[c]);
+      d = _mm256_set1_ps(dc);
+      k = _mm256_setr_ps(1, 2, 3, 4, 5, 6, 7, 8);
+      for (n = 0; n + 8 <= count; n += 8) {
+         _mm256_storeu_ps(bus + n, _mm256_add_ps(_mm256_loadu_ps(bus + n),
+            _mm256_mul_ps(_mm256_add_ps(f, _mm256_mul_ps(d, k)), _mm256_loadu_ps(in + n))));
+         k = _mm256_add_ps(k, eight);
+      }
+      for (; n < count; n++)
+         bus[n] += (from[c] + dc * (n + 1)) * in[n];
+   }
+}
+
+/* eight frames at a time, their lane products summed by a tree of hadds */
+__attribute__((target("avx2")))
+static void pan_lanes_avx2(float *bus, int stride, int channels, const float *in, int count,
+                           const float *from, const float *to)
+{
+   __m256 f, d, p[8], h01, h23, h45, h67, lo, hi;
+   float dl[WG_LANES] __attribute__((aligned(32))), sum;
+   int c, n, i, j;
+
+   for (c = 0; c < channels; c++, bus += stride, from += WG_LANES, to += WG_LANES) {
+      if (silent(from, to, WG_LANES))
+         continue;
+      for (i = 0; i < WG_LANES; i++)
+         dl[i] = (to[i] - from[i]) / count;
+      f = _mm256_loadu_ps(from);
+      d = _mm256_load_ps(dl);
+      for (n = 0; n + 8 <= count; n += 8) {
+         for (j = 0; j < 8; j++)
+            p[j] = _mm256_mul_ps(_mm256_add_ps(f, _mm256_mul_ps(d, _mm256_set1_ps(n + j + 1))),
+                                 _mm256_load_ps(in + (n + j) * WG_LANES));
+         h01 = _mm256_hadd_ps(p[0], p[1]);
+         h23 = _mm256_hadd_ps(p[2], p[3]);
+         h45 = _mm256_hadd_ps(p[4], p[5]);
+         h67 = _mm256_hadd_ps(p[6], p[7]);
+         h01 = _mm256_hadd_ps(h01, h23); /* frames 0-3, low lanes then high lanes */
+         h45 = _mm256_hadd_ps(h45, h67); /* frames 4-7 */
+         lo = _mm256_permute2f128_ps(h01, h45, 0x20);
+         hi = _mm256_permute2f128_ps(h01, h45, 0x31);
+         _mm256_storeu_ps(bus + n, _mm256_add_ps(_mm256_loadu_ps(bus + n), _mm256_add_ps(lo, hi)));
+      }
+      for (; n < count; n++) {
+         sum = 0;
+         for (i = 0; i < WG_LANES; i++)
+            sum += (from[i] + dl[i] * (n + 1)) * in[n * WG_LANES + i];
+         bus[n] += sum;
+      }
+   }
+}
+
+/* count must be a multiple of 8 */
+__attribute__((target("avx2,fma")))
+static float dot_avx2(const float *a, const float *b, int count)
+{
+   __m256 acc = _mm256_setzero_ps();
+   __m128 s;
+   int n;
+
+   for (n = 0; n < count; n += 8)
+      acc = _mm256_fmadd_ps(_mm256_loadu_ps(a + n), _mm256_loadu_ps(b + n), acc);
+   s = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+   s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+   s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+   return _mm_cvtss_f32(s);
+}
+
+/* count must be a multiple of 8 */
+__attribute__((target("avx2,fma")))
+static void cmac_avx2(float *yr, float *yi, const float *ar, const float *ai,
+                      const float *br, const float *bi, int count)
+{
+   __m256 a, b, c, d;
+   int n;
+
+   for (n = 0; n < count; n += 8) {
+      a = _mm256_loadu_ps(ar + n);
+      b = _mm256_loadu_ps(ai + n);
+      c = _mm256_loadu_ps(br + n);
+      d = _mm256_loadu_ps(bi + n);
+      _mm256_storeu_ps(yr + n, _mm256_fnmadd_ps(b, d, _mm256_fmadd_ps(a, c, _mm256_loadu_ps(yr + n))));
+      _mm256_storeu_ps(yi + n, _mm256_fmadd_ps(b, c, _mm256_fmadd_ps(a, d, _mm256_loadu_ps(yi + n))));
+   }
+}
+
+/* all eight lanes in one register, reads are a single gather */
+__attribute__((target("avx2,fma")))
+static void waveguide_avx2(struct wg_lanes *l, float *out, int count)
+{
+   const __m256i mask = _mm256_set1_epi32(WG_MASK), one = _mm256_set1_epi32(1);
+   const __m256i base = _mm256_load_si256((const __m256i *)l->base);
+   const __m256i len = _mm256_load_si256((const __m256i *)l->length);
+   const __m256 tune = _mm256_load_ps(l->tune), gain = _mm256_load_ps(l->loss_gain);
+   const __m256 pole = _mm256_load_ps(l->loss_pole), disp = _mm256_load_ps(l->disp);
+   __m256i pos = _mm256_load_si256((const __m256i *)l->pos);
+   __m256 tx = _mm256_load_ps(l->tune_x), ty = _mm256_load_ps(l->tune_y);
+   __m256 ly = _mm256_load_ps(l->loss_y);
+   __m256 dx = _mm256_load_ps(l->disp_x), dy = _mm256_load_ps(l->disp_y);
+   __m256 x, y;
+   int wr[8] __attribute__((aligned(32)));
+   int n, i;
+
+   for (n = 0; n < count; n++) {
+      x = _mm256_i32gather_ps(l->line, _mm256_add_epi32(base,
+             _mm256_and_si256(_mm256_sub_epi32(pos, len), mask)), 4);
+      y = _mm256_fmadd_ps(tune, _mm256_sub_ps(x, ty), tx);
+      tx = x;
+      ty = y;
+      y = _mm256_fmadd_ps(gain, y, _mm256_mul_ps(pole, ly));
+      ly = y;
+      x = _mm256_fmadd_ps(disp, _mm256_sub_ps(y, dy), dx);
+      dx = y;
+      dy = x;
+      _mm256_store_si256((__m256i *)wr, _mm256_add_epi32(base, _mm256_and_si256(pos, mask)));
+      _mm256_store_ps(out + n * WG_LANES, x);
+      for (i = 0; i < 8; i++)
+         l->line[wr[i]] = out[n * WG_LANES + i];
+      pos = _mm256_add_epi32(pos, one);
+   }
+
+   _mm256_store_si256((__m256i *)l->pos, pos);
+   _mm256_store_ps(l->tune_x, tx);
+   _mm256_store_ps(l->tune_y, ty);
+   _mm256_store_ps(l->loss_y, ly);
+   _mm256_store_ps(l->disp_x, dx);
+   _mm256_store_ps(l->disp_y, dy);
+}
+
+#endif /* HAVE_X86_KERNELS */
+
+void kernels_init(void)
+{
+   kernels.name = "scalar";
+   kernels.sine = sine_scalar;
+   kernels.to_float = to_float_scalar;
+   kernels.to_s32 = to_s32_scalar;
+   kernels.to_s24_3 = to_s24_3_scalar;
+   kernels.to_s16 = to_s16_scalar;
+   kernels.pan = pan_scalar;
+   kernels.pan_lanes = pan_lanes_scalar;
+   kernels.interleave = interleave_scalar;
+   kernels.dot = dot_scalar;
+   kernels.cmac = cmac_scalar;
+   kernels.waveguide = waveguide_scalar;
+
+#ifdef HAVE_X86_KERNELS
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("sse2")) {
+      kernels.name = "sse2";
+      kernels.sine = sine_sse2;
+      kernels.to_float = to_float_sse2;
+      kernels.to_s32 = to_s32_sse2;
+      kernels.to_s24_3 = to_s24_3_sse2;
+      kernels.to_s16 = to_s16_sse2;
+      kernels.pan = pan_sse2;
+      kernels.pan_lanes = pan_lanes_sse2;
+      kernels.interleave = interleave_sse2;
+      kernels.dot = dot_sse2;
+      kernels.cmac = cmac_sse2;
+      kernels.waveguide = waveguide_sse2;
+   }
+   if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+      kernels.name = "avx2";
+      kernels.sine = sine_avx2;
+      kernels.to_float = to_float_avx2;
+      kernels.to_s32 = to_s32_avx2;
+      kernels.to_s24_3 = to_s24_3_avx2;
+      kernels.to_s16 = to_s16_avx2;
+      kernels.pan = pan_avx2;
+      kernels.pan_lanes = pan_lanes_avx2;
+      kernels.dot = dot_avx2;
+      kernels.cmac = cmac_avx2;
+      kernels.waveguide = waveguide_avx2;
+      /* interleaving is bound by memory bandwidth, SSE2 is as fast */
+   }
+#endif
+
+   if (verbose)
+      fprintf(stderr, "Render kernels: %s\n", kernels.name);
+}
+
+/* convert count frames of the mix to format f */
+void convert(enum sample_format f, void *out, const float *in, int count, struct dither *d)
+{
+   switch (f) {
+      case FMT_FLOAT:
+         kernels.to_float(out, in, count);
+         break;
+      case FMT_S32:
+         kernels.to_s32(out, in, count);
+         break;
+      case FMT_S24_3:
+         kernels.to_s24_3(out, in, count);
+         break;
+      default:
+         kernels.to_s16(out, in, count, d);
+   }
+}
@@ -0,0 +1,108 @@
+/*
+ *  latency.c  note latency histogram of Piano.
+ *
+ *  Copyright (C) 2008 Tigran Aivazian <tigran@bibles.org.uk>
+ *
+ *  Records, for every NOTEON, the time from its arrival in the MIDI thread
+ *  until its first frame leaves the device.  Latencies are binned in
+ *  microseconds into LAT_SUB buckets per power of two, so a reading is
+ *  good to within 1/(2 * LAT_SUB) of its value at any scale.
+ *
+ *  The audio thread records and the shell reads and resets.  Both sides
+ *  only use atomic operations on the counters, so neither ever waits and
+ *  a reset racing a record loses nothing: the sample lands either before
+ *  or after it.
+ */
+
+#include <stdio.h>
+#include "piano.h"
+
+#define LAT_SUB_BITS 3
+#define LAT_SUB      (1 << LAT_SUB_BITS) /* buckets per power of two */
+#define LAT_OCTAVES  26                  /* up to a few minutes */
+#define LAT_BUCKETS  (LAT_OCTAVES * LAT_SUB)
+
+static unsigned long buckets[LAT_BUCKETS];
+static unsigned long long max_us;
+
+/* values below LAT_SUB have a bucket each, above that LAT_SUB per octave */
+static int bucket_of(unsigned long long us)
+{
+   int msb, b;
+
+   if (us < LAT_SUB)
+      return us;
+   msb = 63 - __builtin_clzll(us);
+   b = (msb - LAT_SUB_BITS + 1) * LAT_SUB + ((us >> (msb - LAT_SUB_BITS)) & (LAT_SUB - 1));
+   return (b < LAT_BUCKETS) ? b : LAT_BUCKETS - 1;
+}
+
+/* the smallest value falling into bucket b */
+static unsigned long long bucket_floor(int b)
+{
+   int octave = b / LAT_SUB, sub = b % LAT_SUB;
+
+   if (octave == 0)
+      return sub;
+   return (unsigned long long)(LAT_SUB + sub) << (octave - 1);
+}
+
+/* audio thread: an event that arrived at 'arrival' plays at 'out', both in ns */
+void latency_record(unsigned long long arrival, unsigned long long out)
+{
+   unsigned long long us = (out > arrival) ? (out - arrival) / 1000 : 0;
+   unsigned long long max = __atomic_load_n(&max_us, __ATOMIC_RELAXED);
+
+   __atomic_fetch_add(&buckets[bucket_of(us)], 1, __ATOMIC_RELAXED);
+   while (us > max && !__atomic_compare_exchange_n(&max_us, &max, us, 1,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      ;
+}
+
+void latency_reset(void)
+{
+   int b;
+
+   for (b = 0; b < LAT_BUCKETS; b++)
+      __atomic_exchange_n(&buckets[b], 0, __ATOMIC_RELAXED);
+   __atomic_exchange_n(&max_us, 0, __ATOMIC_RELAXED);
+}
+
+/* the value below which a fraction q of the samples lie, mid-bucket */
+static unsigned long long percentile(const unsigned long *snap, unsigned long total, double q)
+{
+   unsigned long long rank = q * total, seen = 0;
+   int b;
+
+   for (b = 0; b < LAT_BUCKETS; b++) {
+      seen += snap[b];
+      if (seen > rank)
+         return (bucket_floor(b) + bucket_floor(b + 1)) / 2;
+   }
+   return bucket_floor(LAT_BUCKETS);
+}
+
+void latency_print(void)
+{
+   unsigned long snap[LAT_BUCKETS], total = 0;
+   unsigned long long max = __atomic_load_n(&max_us, __ATOMIC_RELAXED), p50, p99;
+   int b;
+
+   for (b = 0; b < LAT_BUCKETS; b++) {
+      snap[b] = __atomic_load_n(&buckets[b], __ATOMIC_RELAXED);
+      total += snap[b];
+   }
+   if (!total) {
+      printf("note latency: no notes played yet\n");
+      return;
+   }
+   /* a bucket's middle can lie past the largest sample in it */
+   p50 = percentile(snap, total, 0.50);
+   p99 = percentile(snap, total, 0.99);
+   if (p50 > max)
+      p50 = max;
+   if (p99 > max)
+      p99 = max;
+   printf("note latency over %lu notes: p50 %.2fms, p99 %.2fms, max %.2fms\n", total,
+      p50 / 1000.0, p99 / 1000.0, max / 1000.0);
+}
@@ -2,23 +2,50 @@
  *  midi.c  midi module of Piano.
  *
  *  Copyright (C) 2008 Tigran Aivazian <tigran@bibles.org.uk>
+ *
+ *  Every -i source gets an input port of its own, subscribed with
+ *  snd_seq_connect_from().  The MIDI thread sleeps in poll() and on every
+ *  wakeup drains all pending sequencer events into one batch, so a chord
+ *  or a glissando costs one wakeup of the audio thread, not one per note.
+ *
+ *  The ports stamp every event with the real time of a queue of ours as
+ *  it arrives, so events drained together still keep the times they were
+ *  played at and land on their own frames of the period.
  */
 
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #include <sys/poll.h>
 #include <errno.h>
-#include <assert.h>
 #include <pthread.h>
 #include <alsa/asoundlib.h>
 #include "piano.h"
 
 static unsigned char midi_channel = 0;
-static int port;
+static int midi_channel_given = 0; /* -m was used */
+#define MIDI_BATCH 256            /* events handed to the audio thread at once */
+#define MIDI_INPUT_BUFFER 65536   /* bytes of sequencer input buffer, absorbs bursts */
+
+static char *sources[MAXMIDIPORTS]; /* client:port addresses to connect from */
+static int nsources;
+static int ports[MAXMIDIPORTS];
+static int nports;
 static snd_seq_t *seq; /* initialised by snd_seq_open() in midi_init() */
+static int queue = -1; /* whose real time stamps the events, -1 if none */
+static unsigned long long queue_base; /* now_ns() when the queue's clock read 0 */
 static char *seqdevname = "default";
 static pthread_t midi_thrid;
 
+void set_midi_source(char *addr)
+{
+   if (nsources == MAXMIDIPORTS) {
+      fprintf(stderr, "piano: too many MIDI inputs, at most %d are allowed\n", MAXMIDIPORTS);
+      exit(1);
+   }
+   sources[nsources++] = strdup(addr);
+}
+
 void set_midichan(unsigned char chan)
 {
    if (chan < 1 || chan > 16) {
@@ -27,15 +54,94 @@ void set_midichan(unsigned char chan)
       exit(1);
    }
    midi_channel = chan - 1;
+   midi_channel_given = 1;
+}
+
+/* offline rendering plays every channel unless -m restricts it */
+int midichan_accepts(unsigned char chan)
+{
+   return !midi_channel_given || chan == midi_channel;
 }
 
 static void *midi_thread(void *arg);
 
-void midi_init(void)
+/* create an input port and subscribe it to source, a "client:port" address */
+static void connect_source(const char *source)
+{
+   snd_seq_port_info_t *pinfo;
+   snd_seq_addr_t addr;
+   char name[32];
+   int port, err;
+
+   if (nports)
+      snprintf(name, sizeof(name), "piano %d", nports + 1);
+   else
+      strcpy(name, "piano");
+   snd_seq_port_info_alloca(&pinfo);
+   snd_seq_port_info_set_name(pinfo, name);
+   snd_seq_port_info_set_capability(pinfo, SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE);
+   snd_seq_port_info_set_type(pinfo, SND_SEQ_PORT_TYPE_APPLICATION);
+   if (queue >= 0) {
+      snd_seq_port_info_set_timestamping(pinfo, 1);
+      snd_seq_port_info_set_timestamp_real(pinfo, 1);
+      snd_seq_port_info_set_timestamp_queue(pinfo, queue);
+   }
+   err = snd_seq_create_port(seq, pinfo);
+   if (err < 0) {
+      fprintf(stderr, "%s: Error creating MIDI port: %s\n",
+         __func__, snd_strerror(err));
+      exit(1);
+   }
+   port = snd_seq_port_info_get_port(pinfo);
+   ports[nports++] = port;
+
+   if (!source)
+      return;
+   err = snd_seq_parse_address(seq, &addr, source);
+   if (err < 0) {
+      fprintf(stderr, "%s: Invalid MIDI source \"%s\": %s\n", __func__, source, snd_strerror(err));
+      exit(1);
+   }
+   err = snd_seq_connect_from(seq, port, addr.client, addr.port);
+   if (err < 0)
+      fprintf(stderr, "%s: Can't connect from %s: %s\n", __func__, source, snd_strerror(err));
+   else if (verbose)
+      fprintf(stderr, "MIDI input from %d:%d on port %d\n", addr.client, addr.port, port);
+}
+
+/* start the queue that stamps events, and find what its clock reads in now_ns() time */
+static void start_queue(void)
 {
+   snd_seq_queue_status_t *status;
+   const snd_seq_real_time_t *rt;
    int err;
 
-   err = snd_seq_open(&seq, seqdevname, SND_SEQ_OPEN_INPUT, 0);
+   queue = snd_seq_alloc_named_queue(seq, "piano");
+   if (queue < 0) {
+      fprintf(stderr, "%s: Can't allocate a queue, events are stamped as they are read: %s\n",
+         __func__, snd_strerror(queue));
+      return;
+   }
+   snd_seq_queue_status_alloca(&status);
+   if ((err = snd_seq_start_queue(seq, queue, NULL)) < 0 ||
+       (err = snd_seq_drain_output(seq)) < 0 ||
+       (err = snd_seq_get_queue_status(seq, queue, status)) < 0) {
+      fprintf(stderr, "%s: Can't start the queue, events are stamped as they are read: %s\n",
+         __func__, snd_strerror(err));
+      snd_seq_free_queue(seq, queue);
+      queue = -1;
+      return;
+   }
+   rt = snd_seq_queue_status_get_real_time(status);
+   queue_base = now_ns() - (rt->tv_sec * 1000000000ULL + rt->tv_nsec);
+}
+
+void midi_init(void)
+{
+   int err, i;
+
+   /* duplex, starting our queue takes an event to the system timer */
+   err = snd_seq_open(&seq, seqdevname, SND_SEQ_OPEN_DUPLEX, 0);
    if (err) {
       fprintf(stderr, "%s: Error opening devic %s: %s\n",
          __func__, seqdevname, snd_strerror(err));
@@ -49,80 +155,132 @@ void midi_init(void)
       exit(1);
    }
 
-   err = snd_seq_create_simple_port(seq, "piano",
-             SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE,
-             SND_SEQ_PORT_TYPE_APPLICATION);
-   if (err < 0) {
-      fprintf(stderr, "%s: Error creating MIDI port: %s\n",
-         __func__, snd_strerror(err));
-      exit(1);
-   } else
-      port = err;
+   snd_seq_nonblock(seq, 1);
+   err = snd_seq_set_input_buffer_size(seq, MIDI_INPUT_BUFFER);
+   if (err < 0)
+      fprintf(stderr, "%s: Can't set input buffer size: %s\n", __func__, snd_strerror(err));
+
+   start_queue();
+
+   /* without -i, listen to the MIDI Through port as we always have */
+   if (!nsources)
+      connect_source(DEFAULT_MIDI_SOURCE);
+   for (i = 0; i < nsources; i++)
+      connect_source(sources[i]);
 
    err = pthread_create(&midi_thrid, NULL, midi_thread, NULL);
-   if (err < 0) {
+   if (err) {
       fprintf(stderr, "%s: Error creating MIDI thread: %s\n",
-         __func__, strerror(errno));
+         __func__, strerror(err));
       exit(1);
    }
-
-   system("aconnect 14:0 128:0"); /* XXX do this properly! */
-   return;
 }
 
 void midi_cleanup(void)
 {
-   snd_seq_delete_port(seq, port);
+   int i;
+
+   for (i = 0; i < nports; i++)
+      snd_seq_delete_port(seq, ports[i]);
+   if (queue >= 0)
+      snd_seq_free_queue(seq, queue);
    snd_seq_close(seq);
 }
 
+/* the audio thread must never wait for us, so if it falls behind we wait */
+static void queue_batch(const struct note_event *batch, int count)
+{
+   int i;
+
+   for (i = 0; i < count; i++) {
+      while (!event_push(&batch[i])) {
+         audio_wakeup();
+         usleep(1000);
+      }
+   }
+   audio_wakeup();
+}
+
+/* when the sequencer received event, or now if it didn't stamp it */
+static unsigned long long event_time(const snd_seq_event_t *event)
+{
+   unsigned long long now = now_ns(), t;
+
+   if (queue < 0 || (event->flags & SND_SEQ_TIME_STAMP_MASK) != SND_SEQ_TIME_STAMP_REAL)
+      return now;
+   t = queue_base + event->time.time.tv_sec * 1000000000ULL + event->time.time.tv_nsec;
+   return (t < now) ? t : now;
+}
+
+/* turn a sequencer event into a note or pedal event, returns 0 if it isn't one for us */
+static int note_event(snd_seq_event_t *event, struct note_event *ev)
+{
+   /* some keyboards (e.g. Casio CTK-900) don't send NoteOFF event but instead
+      send a NoteON with velocity==0. This is allowed by the MIDI Spec.
+      We convert these to NoteOFF. */
+   if ((event->type == SND_SEQ_EVENT_NOTEON) && (event->data.note.velocity == 0))
+      event->type = SND_SEQ_EVENT_NOTEOFF;
+
+   switch (event->type) {
+      case SND_SEQ_EVENT_NOTEON:
+         ev->type = EV_NOTEON;
+         break;
+      case SND_SEQ_EVENT_NOTEOFF:
+         ev->type = EV_NOTEOFF;
+         break;
+      case SND_SEQ_EVENT_CONTROLLER:
+         if (event->data.control.param != 64 || midi_channel != event->data.control.channel)
+            return 0;
+         ev->type = EV_SUSTAIN;
+         ev->note = 0;
+         ev->velocity = event->data.control.value;
+         ev->time = event_time(event);
+         return 1;
+      default:
+         return 0;
+   }
+   if (midi_channel != event->data.note.channel)
+      return 0;
+   ev->note = event->data.note.note;
+   ev->velocity = event->data.note.velocity;
+   ev->time = event_time(event);
+   return 1;
+}
+
 static void *midi_thread(void *arg ATTRIBUTE_UNUSED)
 {
+   int nfds = snd_seq_poll_descriptors_count(seq, POLLIN);
+   struct pollfd ufds[nfds];
+   struct note_event batch[MIDI_BATCH];
+   snd_seq_event_t *event;
+   int n, err;
+
+   snd_seq_poll_descriptors(seq, ufds, nfds, POLLIN);
    while (1) {
-      int err;
-      snd_seq_event_t *event;
-      double freq;
-
-      err = snd_seq_event_input(seq, &event);
-      if (err < 0) {
-         fprintf(stderr, "%s: %s\n", __func__, snd_strerror(err));
-         continue;
+      if (poll(ufds, nfds, -1) < 0 && errno != EINTR) {
+         fprintf(stderr, "%s: poll: %s\n", __func__, strerror(errno));
+         exit(1);
       }
 
-      assert(err == 1); /* normally only one message at a time */
-      assert(event);
-
-      /* some keyboards (e.g. Casio CTK-900) don't send NoteOFF event but instead
-         send a NoteON with velocity==0. This is allowed by the MIDI Spec.
-         We convert these to NoteOFF. */
-      if ((event->type == SND_SEQ_EVENT_NOTEON) && (event->data.note.velocity == 0))
-         event->type = SND_SEQ_EVENT_NOTEOFF;
-
-      switch (event->type) {
-         case SND_SEQ_EVENT_NOTEON:
-            if (midi_channel != event->data.note.channel)
-               break;
-            freq = scale[event->data.note.note].freq;
-            set_freq(freq);
-            signal_value = max_signal_value;
-#if 0
-            if (verbose) printf("%s: NoteON: chan=%d, note=%d, vel=%d (freq=%.3f)\n", __func__, 
-               event->data.note.channel, event->data.note.note, event->data.note.velocity, freq);
-#endif
-            break;
-         case SND_SEQ_EVENT_NOTEOFF:
-            if (midi_channel != event->data.note.channel)
-               break;
-            signal_value = 0;
-#if 0
-            if (verbose) printf("%s: NoteOFF: chan=%d, note=%d, vel=%d\n", __func__,
-               event->data.note.channel, event->data.note.note, event->data.note.velocity);
-#endif
+      /* everything that arrived together is queued together */
+      n = 0;
+      while ((err = snd_seq_event_input(seq, &event)) != -EAGAIN) {
+         if (err == -ENOSPC) {
+            fprintf(stderr, "%s: MIDI input overrun, events were lost\n", __func__);
+            continue;
+         }
+         if (err < 0) {
+            fprintf(stderr, "%s: %s\n", __func__, snd_strerror(err));
             break;
+         }
+         if (note_event(event, &batch[n]) && ++n == MIDI_BATCH) {
+            queue_batch(batch, n);
+            n = 0;
+         }
       }
-
-      snd_seq_free_event(event);
-   } /* while (1) */
+      if (n)
+         queue_batch(batch, n);
+   }
 
    return 0;
 }
@@ -0,0 +1,398 @@
+/*
+ *  pack.c  compressed sample store of Piano.
+ *
+ *  Copyright (C) 2008 Tigran Aivazian <tigran@bibles.org.uk>
+ *
+ *  With --compress every sample is kept in memory losslessly packed
+ *  instead of mapped: each channel's frames are predicted from the ones
+ *  before by a fixed polynomial predictor of order 0 to 4, and what the
+ *  prediction missed is Rice coded.  A stereo sample may code its second
+ *  channel as left minus right, whichever is cheaper.
+ *
+ *  Samples are cut into PACK_BLOCK frame blocks, each with its own
+ *  predictors and starting from silence, so decoding can begin at any of
+ *  them.  Within a block the Rice parameter is chosen afresh every
+ *  PACK_PART frames.  Every voice decodes into a small ring of its own a
+ *  little ahead of where it plays, so the work per period is proportional
+ *  to the frames played and nothing is allocated on the audio thread.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "piano.h"
+
+#define PACK_BLOCK  4096   /* frames per independently decodable block */
+#define PACK_PART   256    /* frames sharing a Rice parameter */
+#define PACK_ORDERS 5      /* fixed predictors of order 0 to 4 */
+#define PACK_KBITS  5      /* bits of a Rice parameter */
+#define PACK_MAXK   30
+#define PACK_ESCAPE 24     /* quotients this long are sent as 32 raw bits */
+#define PACK_PAD    8      /* bytes after the data, a bit read loads 64 bits */
+#define PACK_CACHE  512    /* decoded frames per voice, a power of two */
+#define PACK_AHEAD  64     /* frames decoded at a time */
+#define MAX_FRAME_BYTES 6  /* 24-bit stereo */
+#define BLOCKS_AT(size) (((size) + 7) & ~(size_t)7) /* where the block index follows the data */
+
+struct pack_block {
+   unsigned long long bit[2];  /* where each channel's residuals start */
+   unsigned char order[2];     /* of each channel's predictor */
+   unsigned char side;         /* channel 1 holds left minus right */
+};
+
+struct unpack_channel {
+   unsigned long long bit;     /* next residual */
+   unsigned int k;             /* Rice parameter of the current part */
+   int order;
+   int x[4];                   /* the last frames decoded, newest first */
+};
+
+struct unpack {
+   const struct sample_t *sample;
+   unsigned int pos;           /* next frame to decode */
+   int side;
+   struct unpack_channel ch[2];
+   unsigned char cache[PACK_CACHE * MAX_FRAME_BYTES]; /* frame f at f % PACK_CACHE */
+};
+
+/* the bit stream being written */
+struct pack_writer {
+   unsigned char *buf;
+   size_t size, len;           /* bytes allocated and written */
+   unsigned long long acc;     /* bits not yet written, right aligned */
+   int nacc;
+};
+
+static int packing = 0;
+static struct unpack unpacks[POLYPHONY]; /* one per voice */
+
+void set_pack_mode(void)
+{
+   packing = 1;
+}
+
+int pack_enabled(void)
+{
+   return packing;
+}
+
+static int predict(const int *x, int order)
+{
+   switch (order) {
+      case 1: return x[0];
+      case 2: return 2 * x[0] - x[1];
+      case 3: return 3 * x[0] - 3 * x[1] + x[2];
+      case 4: return 4 * x[0] - 6 * x[1] + 4 * x[2] - x[3];
+   }
+   return 0;
+}
+
+/* signed residuals to unsigned, 0, -1, 1, -2... to 0, 1, 2, 3... */
+static unsigned int zigzag(int r)
+{
+   return ((unsigned int)r << 1) ^ (unsigned int)(r >> 31);
+}
+
+/* frame n of channel c of the block at p, right or side for c == 2 */
+static int pcm(const struct sample_t *s, const unsigned char *p, int n, int c)
+{
+   unsigned int bytes = s->sample_bits / 8;
+   int l, r;
+
+   p += (size_t)n * s->channels * bytes;
+   l = (bytes == 2) ? S16(p) : S24(p);
+   if (c == 0)
+      return l;
+   r = (bytes == 2) ? S16(p + 2) : S24(p + 3);
+   return (c == 1) ? r : l - r;
+}
+
+static void put_bits(struct pack_writer *w, unsigned int bits, int n)
+{
+   w->acc = (w->acc << n) | bits;
+   w->nacc += n;
+   while (w->nacc >= 8) {
+      if (w->len == w->size) {
+         w->size = w->size ? 2 * w->size : 65536;
+         w->buf = realloc(w->buf, w->size);
+         if (!w->buf) {
+            fprintf(stderr, "%s: Can't malloc memory for packed samples\n", __func__);
+            exit(1);
+         }
+      }
+      w->nacc -= 8;
+      w->buf[w->len++] = w->acc >> w->nacc;
+   }
+}
+
+static unsigned long long writer_bit(const struct pack_writer *w)
+{
+   return (unsigned long long)w->len * 8 + w->nacc;
+}
+
+/* residuals of count frames of a channel under a predictor of the given order */
+static void residuals(const int *x, int count, int order, unsigned int *u)
+{
+   int h[4] = { 0, 0, 0, 0 };
+   int n;
+
+   for (n = 0; n < count; n++) {
+      u[n] = zigzag(x[n] - predict(h, n < order ? n : order));
+      h[3] = h[2]; h[2] = h[1]; h[1] = h[0]; h[0] = x[n];
+   }
+}
+
+static unsigned long long rice_bits(const unsigned int *u, int count, unsigned int k)
+{
+   unsigned long long bits = PACK_KBITS;
+   unsigned int q;
+   int n;
+
+   for (n = 0; n < count; n++) {
+      q = u[n] >> k;
+      bits += (q < PACK_ESCAPE) ? q + 1 + k : PACK_ESCAPE + 32;
+   }
+   return bits;
+}
+
+/* the Rice parameter around log2 of the mean that codes u shortest */
+static unsigned int rice_param(const unsigned int *u, int count)
+{
+   unsigned long long sum = 0, bits, best_bits = ~0ULL;
+   unsigned int k = 0, best = 0;
+   int n;
+
+   for (n = 0; n < count; n++)
+      sum += u[n];
+   while (k < PACK_MAXK && ((unsigned long long)count << (k + 1)) <= sum)
+      k++;
+   for (k = k ? k - 1 : 0; k <= PACK_MAXK; k++) {
+      bits = rice_bits(u, count, k);
+      if (bits >= best_bits)
+         break;
+      best_bits = bits;
+      best = k;
+   }
+   return best;
+}
+
+/* cheapest predictor order for x, leaving its residuals in u */
+static int best_order(const int *x, int count, unsigned int *u, unsigned long long *cost)
+{
+   unsigned long long sum, best_sum = ~0ULL;
+   int order, best = 0, n;
+
+   for (order = 0; order < PACK_ORDERS; order++) {
+      residuals(x, count, order, u);
+      for (sum = 0, n = 0; n < count; n++)
+         sum += u[n];
+      if (sum < best_sum) {
+         best_sum = sum;
+         best = order;
+      }
+   }
+   residuals(x, count, best, u);
+   *cost = best_sum;
+   return best;
+}
+
+static void put_residuals(struct pack_writer *w, const unsigned int *u, int count)
+{
+   unsigned int k = 0, q;
+   int n;
+
+   for (n = 0; n < count; n++) {
+      if (n % PACK_PART == 0) {
+         k = rice_param(u + n, (count - n < PACK_PART) ? count - n : PACK_PART);
+         put_bits(w, k, PACK_KBITS);
+      }
+      q = u[n] >> k;
+      if (q < PACK_ESCAPE) {
+         put_bits(w, 1, q + 1);
+         if (k)
+            put_bits(w, u[n] & ((1U << k) - 1), k);
+      } else {
+         put_bits(w, 0, PACK_ESCAPE);
+         put_bits(w, u[n], 32);
+      }
+   }
+}
+
+/*
+ * Pack the frames s->wave_data points at into s->packed.  The caller
+ * still owns, and may then drop, what wave_data points into.  Returns
+ * the bytes the packed sample and its block index take, see pack_move().
+ */
+size_t pack_sample(struct sample_t *s)
+{
+   static int x[3][PACK_BLOCK];
+   static unsigned int u[PACK_BLOCK], v[PACK_BLOCK];
+   struct pack_writer w = { NULL, 0, 0, 0, 0 };
+   unsigned int nblocks = (s->wave_size + PACK_BLOCK - 1) / PACK_BLOCK, b, frame_bytes;
+   unsigned long long cost_r, cost_s;
+   struct pack_block *blocks;
+   const unsigned char *p;
+   int count, n, c, order_s;
+
+   blocks = calloc(nblocks ? nblocks : 1, sizeof(*blocks));
+   if (!blocks) {
+      fprintf(stderr, "%s: Can't malloc memory for packed samples\n", __func__);
+      exit(1);
+   }
+   frame_bytes = s->channels * (s->sample_bits / 8);
+
+   for (b = 0; b < nblocks; b++) {
+      p = s->wave_data + (size_t)b * PACK_BLOCK * frame_bytes;
+      count = (s->wave_size - b * PACK_BLOCK < PACK_BLOCK) ? s->wave_size - b * PACK_BLOCK : PACK_BLOCK;
+      for (c = 0; c < (s->channels == 2 ? 3 : 1); c++)
+         for (n = 0; n < count; n++)
+            x[c][n] = pcm(s, p, n, c);
+
+      blocks[b].bit[0] = writer_bit(&w);
+      blocks[b].order[0] = best_order(x[0], count, u, &cost_r);
+      put_residuals(&w, u, count);
+      if (s->channels == 1)
+         continue;
+
+      blocks[b].bit[1] = writer_bit(&w);
+      order_s = best_order(x[2], count, v, &cost_s);
+      blocks[b].order[1] = best_order(x[1], count, u, &cost_r);
+      if (cost_s < cost_r) {
+         blocks[b].side = 1;
+         blocks[b].order[1] = order_s;
+         memcpy(u, v, count * sizeof(*u));
+      }
+      put_residuals(&w, u, count);
+   }
+   put_bits(&w, 0, 7); /* flush the last byte */
+
+   s->packed = realloc(w.buf, w.len + PACK_PAD);
+   if (!s->packed) {
+      fprintf(stderr, "%s: Can't malloc memory for packed samples\n", __func__);
+      exit(1);
+   }
+   memset((unsigned char *)s->packed + w.len, 0, PACK_PAD);
+   s->packed_size = w.len + PACK_PAD;
+   s->blocks = blocks;
+   return BLOCKS_AT(s->packed_size) + nblocks * sizeof(*blocks);
+}
+
+/*
+ * Move the packed sample to the pack_sample() bytes at to, 8 byte aligned,
+ * which stay the caller's to free.  Returns the bytes it took.
+ */
+size_t pack_move(struct sample_t *s, unsigned char *to)
+{
+   unsigned int nblocks = (s->wave_size + PACK_BLOCK - 1) / PACK_BLOCK;
+   size_t at = BLOCKS_AT(s->packed_size);
+
+   memcpy(to, s->packed, s->packed_size);
+   memcpy(to + at, s->blocks, nblocks * sizeof(*s->blocks));
+   free((void *)s->packed);
+   free((void *)s->blocks);
+   s->packed = to;
+   s->blocks = (const struct pack_block *)(to + at);
+   return at + nblocks * sizeof(*s->blocks);
+}
+
+/* the 64 bits of the stream starting at bit */
+static unsigned long long window(const unsigned char *buf, unsigned long long bit)
+{
+   unsigned long long w;
+
+   memcpy(&w, buf + (bit >> 3), sizeof(w));
+   return __builtin_bswap64(w) << (bit & 7);
+}
+
+static int get_residual(const unsigned char *buf, struct unpack_channel *ch)
+{
+   unsigned long long w = window(buf, ch->bit);
+   unsigned int q = w ? __builtin_clzll(w) : 64, u;
+
+   if (q >= PACK_ESCAPE) {
+      u = (w << PACK_ESCAPE) >> 32;
+      ch->bit += PACK_ESCAPE + 32;
+   } else {
+      u = (q << ch->k) | ((w << (q + 1)) >> 1 >> (63 - ch->k));
+      ch->bit += q + 1 + ch->k;
+   }
+   return (int)(u >> 1) ^ -(int)(u & 1);
+}
+
+static void unpack_frame(struct unpack *d)
+{
+   const struct sample_t *s = d->sample;
+   const struct pack_block *blk = &s->blocks[d->pos / PACK_BLOCK];
+   unsigned int n = d->pos % PACK_BLOCK;
+   unsigned char *out = d->cache + (d->pos % PACK_CACHE) * s->channels * (s->sample_bits / 8);
+   struct unpack_channel *ch;
+   int c, x[2];
+
+   for (c = 0; c < s->channels; c++) {
+      ch = &d->ch[c];
+      if (n == 0) {
+         ch->bit = blk->bit[c];
+         ch->order = blk->order[c];
+         memset(ch->x, 0, sizeof(ch->x));
+         d->side = blk->side;
+      }
+      if (n % PACK_PART == 0) {
+         ch->k = window(s->packed, ch->bit) >> (64 - PACK_KBITS);
+         ch->bit += PACK_KBITS;
+      }
+      x[c] = get_residual(s->packed, ch) + predict(ch->x, (int)n < ch->order ? (int)n : ch->order);
+      ch->x[3] = ch->x[2]; ch->x[2] = ch->x[1]; ch->x[1] = ch->x[0]; ch->x[0] = x[c];
+   }
+   if (d->side)
+      x[1] = x[0] - x[1];
+
+   for (c = 0; c < s->channels; c++)
+      if (s->sample_bits == 16) {
+         *out++ = x[c];
+         *out++ = x[c] >> 8;
+      } else {
+         *out++ = x[c];
+         *out++ = x[c] >> 8;
+         *out++ = x[c] >> 16;
+      }
+   d->pos++;
+}
+
+/* audio thread: v starts playing its packed sample from the beginning */
+void pack_start(struct voice *v)
+{
+   struct unpack *d = &unpacks[v->id];
+
+   d->sample = v->sample;
+   d->pos = 0;
+}
+
+/*
+ * Audio thread: return the decoded frames starting at frame pos, trimming
+ * *count to what is contiguous in the voice's ring.  Decodes what is
+ * missing first, going back to the start of pos's block if the voice has
+ * moved somewhere the ring doesn't cover.
+ */
+const unsigned char *pack_frames(struct voice *v, unsigned int pos, int *count)
+{
+   struct unpack *d = &unpacks[v->id];
+   const struct sample_t *s = d->sample;
+   unsigned int end, n = *count;
+
+   if (n > PACK_CACHE / 2)
+      n = PACK_CACHE / 2;
+   if (n > PACK_CACHE - pos % PACK_CACHE)
+      n = PACK_CACHE - pos % PACK_CACHE;
+   if (n > s->wave_size - pos)
+      n = s->wave_size - pos;
+   *count = n;
+
+   if (pos > d->pos || pos + PACK_CACHE < d->pos + PACK_AHEAD)
+      d->pos = pos - pos % PACK_BLOCK;
+   end = (pos + n + PACK_AHEAD - 1) / PACK_AHEAD * PACK_AHEAD;
+   if (end > s->wave_size)
+      end = s->wave_size;
+   while (d->pos < end)
+      unpack_frame(d);
+   return d->cache + (pos % PACK_CACHE) * s->channels * (s->sample_bits / 8);
+}
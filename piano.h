@@ -4,6 +4,9 @@
  *  Copyright (C) 2008 Tigran Aivazian <tigran@bibles.org.uk>
  */
 
+#include <stdio.h>
+#include <sys/types.h>
+
 #ifndef ATTRIBUTE_UNUSED
 /* do not print warning (gcc) when function parameter is not used */
 #define ATTRIBUTE_UNUSED __attribute__ ((__unused__))
@@ -28,6 +31,26 @@
 #define MINPERIODTIME  1000
 #define MAXPERIODTIME  1000000
 
+/* range for the SCHED_FIFO priority of the audio thread */
+#define MINRTPRIO 1
+#define MAXRTPRIO 99
+
+/* range for the number of offline render threads */
+#define MINJOBS 1
+#define MAXJOBS 64
+
+/* range for the resident head of streamed samples (in milliseconds) */
+#define MINHEADTIME  50
+#define MAXHEADTIME  10000
+
+/* range for the envelope times (in milliseconds) */
+#define MINENVTIME 0
+#define MAXENVTIME 60000
+
+/* range for the stereo spread of the keyboard (in percent) */
+#define MINSPREAD 0
+#define MAXSPREAD 100
+
 /* init.c */
 extern int verbose;
 extern void init(int argc, char *argv[]);
@@ -38,23 +61,333 @@ extern int stop_pending(void);
 /* scales.c */
 #define MINMIDINOTE  21    /* A0 */
 #define MAXMIDINOTE 108    /* C8 */
-struct scale {
-   char *name;  /* note name like "A0", "A0#" etc */
-   double freq; /* fundamental frequency in Hz */
+struct tuning {
+   char name[256];                 /* of the temperament or the Scala file */
+   double freq[MAXMIDINOTE + 1];   /* fundamental of each key in Hz */
+   double step[MAXMIDINOTE + 1];   /* the same in cycles per frame at the stream rate */
 };
-extern struct scale *scale;
+extern char *note_names[];
+extern void set_tuning(char *name);
+extern const struct tuning *get_tuning(void);
+extern const struct tuning *get_equal_tuning(void);
+extern int tuning_select(const char *name);
+extern void tunings_print(void);
 extern void scales_init(void);
 
 /* midi.c */
+#define MAXMIDIPORTS 16 /* MIDI sources that can be connected at once */
+#define DEFAULT_MIDI_SOURCE "14:0" /* MIDI Through */
 extern void set_midichan(unsigned char chan);
+extern void set_midi_source(char *addr);
+extern int midichan_accepts(unsigned char chan);
 
 /* audio.c */
+/* sample formats of the output, best first */
+enum sample_format { FMT_FLOAT, FMT_S32, FMT_S24_3, FMT_S16, NFORMATS, FMT_AUTO = -1 };
+extern const char *const format_names[NFORMATS];
+extern const unsigned int format_bits[NFORMATS];
+/* where a channel's samples are, in bits like snd_pcm_channel_area_t */
+struct audio_area {
+   void *addr;
+   unsigned int first;     /* offset of the first sample */
+   unsigned int step;      /* distance between samples */
+};
+/* a place the rendered periods go */
+struct backend {
+   const char *name;
+   /* open the output, returning the ring and period sizes in frames
+      and the sample format it settled on */
+   void (*open)(const char *arg, unsigned long *buffer_size, unsigned long *period_size,
+                enum sample_format *format);
+   /* sleep until a period is free or wakeup_fd is readable */
+   void (*wait)(int wakeup_fd);
+   long (*avail)(void);       /* frames free in the ring, <0 if it can't recover */
+   long (*delay)(void);       /* frames until a frame written now is heard */
+   /* areas to write up to *frames frames at *offset into, <0 on error */
+   int (*begin)(const struct audio_area **areas, unsigned long *offset, unsigned long *frames);
+   int (*commit)(unsigned long offset, unsigned long frames);
+   void (*start)(void);       /* start playing if not already */
+   void (*stop)(void);        /* drop what is queued and wait for start */
+   void (*close)(void);
+};
+extern void set_backend(char *spec);
+extern void set_format(char *name);
 extern void set_rate(unsigned int rate);
 extern void set_pcm_devname(char *name);
 extern void set_channels(unsigned int c);
 extern void set_buffer_time(unsigned int b);
 extern void set_period_time(unsigned int p);
 extern void set_resample(void);
-extern void set_freq(double f);
-extern int max_signal_value; /* maximum value of a 16-bit signal */
-extern int signal_value; /* current signal value */
+extern void set_rt_priority(int p);
+extern void set_audio_cpu(int cpu);
+extern void set_lock_memory(void);
+extern void audio_lock(const void *p, size_t size);
+extern unsigned int get_rate(void);
+extern unsigned int get_channels(void);
+extern enum sample_format get_format(void);
+extern unsigned int get_buffer_time(void);
+extern unsigned int get_period_time(void);
+extern const char *get_pcm_devname(void);
+extern int get_resample(void);
+extern void audio_count_xrun(int suspend, unsigned long long start);
+extern void audio_print_stats(FILE *f);
+extern void audio_wakeup(void);
+
+/* alsa.c */
+extern const struct backend alsa_backend;
+
+/* sinks.c */
+extern const struct backend null_backend, clock_backend, file_backend;
+
+/* kernels.c */
+#define DITHER_LANES 8
+/* state of the TPDF dither of 16-bit output, see dither_init() */
+struct dither {
+   unsigned int s[DITHER_LANES];
+};
+struct wg_lanes;
+struct kernels {
+   const char *name;
+   /* add amp * sin() of count frames starting at *phase to out */
+   void (*sine)(float *out, int count, double *phase, double step, float amp);
+   /* convert [-1.0, 1.0] floats to each output format with saturation */
+   void (*to_float)(float *out, const float *in, int count);
+   void (*to_s32)(int *out, const float *in, int count);
+   void (*to_s24_3)(unsigned char *out, const float *in, int count);
+   void (*to_s16)(short *out, const float *in, int count, struct dither *d);
+   /* add in to each of 'channels' planes stride floats apart in bus, with
+      gains going from from[c] to to[c] over the count frames */
+   void (*pan)(float *bus, int stride, int channels, const float *in, int count,
+               const float *from, const float *to);
+   /* the same for WG_LANES signals, frame n of lane i at in[n * WG_LANES + i]
+      and the gains of channel c, lane i at from[c * WG_LANES + i] */
+   void (*pan_lanes)(float *bus, int stride, int channels, const float *in, int count,
+                     const float *from, const float *to);
+   /* interleave 'channels' planar buffers of 'bytes' wide samples into out */
+   void (*interleave)(void *out, void *const *in, int channels, int count, int bytes);
+   /* inner product of two float vectors, count is a multiple of 8 */
+   float (*dot)(const float *a, const float *b, int count);
+   /* y += a * b over count complex numbers held as real and imaginary
+      arrays, count is a multiple of 8 */
+   void (*cmac)(float *yr, float *yi, const float *ar, const float *ai,
+                const float *br, const float *bi, int count);
+   /* advance WG_LANES waveguide strings count frames, lane i of frame n to out[n * WG_LANES + i] */
+   void (*waveguide)(struct wg_lanes *l, float *out, int count);
+};
+extern struct kernels kernels;
+extern void kernels_init(void);
+extern void dither_init(struct dither *d);
+extern void convert(enum sample_format f, void *out, const float *in, int count, struct dither *d);
+
+/* events.c */
+#define EV_NOTEON  1
+#define EV_NOTEOFF 2
+#define EV_SUSTAIN 3 /* sustain pedal, the CC64 value in velocity */
+struct note_event {
+   unsigned char type;      /* EV_NOTEON, EV_NOTEOFF or EV_SUSTAIN */
+   unsigned char note;      /* MIDI note number */
+   unsigned char velocity;  /* MIDI velocity (1...127) */
+   unsigned long long time; /* arrival time in nanoseconds, see now_ns() */
+};
+extern unsigned long long now_ns(void);
+extern int event_push(const struct note_event *ev);
+extern struct note_event *event_peek(void);
+extern void event_pop(void);
+
+/* latency.c */
+extern void latency_record(unsigned long long arrival, unsigned long long out);
+extern void latency_reset(void);
+extern void latency_print(void);
+
+/* voice.c */
+struct sample_t;
+struct voice {
+   int id;              /* index in the pool, never changes */
+   int note;            /* MIDI note number being played */
+   int velocity;        /* it was struck with (1...127) */
+   float amplitude;     /* linear gain, 1.0 is full scale */
+   unsigned long age;   /* allocation stamp, used to find the oldest voice */
+   int finished;        /* set by voices_render_chunk(), see voices_reap() */
+   float pan;           /* position from 0 (first channel) to 1 (last channel) */
+   float gain[MAXCHANNELS];   /* per channel gain at the start of the next block */
+   float target[MAXCHANNELS]; /* and at its end, see voice_gains() */
+   int stage;           /* of the envelope: attack, decay or release */
+   int sustained;       /* released while the sustain pedal was down */
+   float env;           /* envelope at the start of the next block */
+   float env_end;       /* and at its end */
+   /* sine engine */
+   double phase;        /* current oscillator phase in radians */
+   double phase_step;   /* phase increment per frame */
+   /* wavetable engine */
+   const float *table;  /* band-limited table for this note's octave */
+   unsigned int table_phase; /* 32-bit fixed point, one cycle = 2^32 */
+   unsigned int table_step;
+   /* sample engine */
+   const struct sample_t *sample;
+   unsigned int sample_pos; /* next frame to read from the sample */
+   unsigned long long sample_step; /* frames read per frame played, 32.32 fixed point */
+   const float *bank;   /* resampler bank for that ratio, see resample_pick() */
+   unsigned long long hist_pos; /* play position within the voice's history, 32.32 */
+   int hist_len;        /* frames in the voice's history */
+};
+struct engine {
+   const char *name;
+   void (*start)(struct voice *v, const struct tuning *t); /* set up a new note */
+   /* add count frames to out, return 0 once the voice has finished,
+      unused if the engine has render_group() */
+   int (*render)(struct voice *v, float *out, int count);
+   void (*stop)(struct voice *v); /* optional, called when the voice is freed */
+   /* optional, renders n voices at once instead of render() on each and
+      pans them into bus itself, setting finished on those that are done */
+   void (*render_group)(struct voice **v, int n, float *bus, int stride, int count);
+   /* optional, move a sounding voice to another tuning without a click */
+   void (*retune)(struct voice *v, const struct tuning *t);
+};
+extern void set_engine(char *name);
+extern void set_spread(int percent);
+extern void set_envelope(char *spec);
+extern void voice_gains(const struct voice *v, float *from, float *to, int stride,
+                        int start, int end, int count, float scale);
+extern void voices_init(void);
+extern void voice_on(int note, int velocity);
+extern void voice_off(int note);
+extern void voice_sustain(int value);
+extern int voices_active(void);
+extern void voices_render(float *bus, int stride, int count);
+#define VOICE_CHUNK 8 /* voices per unit of work for render_group() engines, WG_LANES */
+extern int voices_chunks(void);
+extern void voices_render_chunk(int c, float *bus, int stride, int count);
+extern void voices_reap(void);
+
+/* waveguide.c */
+#define WG_LANES 8       /* strings advanced together, one per SIMD lane */
+#define WG_DELAY 4096    /* delay line per string, A0 at MAXRATE must fit */
+#define WG_MASK  (WG_DELAY - 1)
+struct wg_lanes {        /* state of WG_LANES strings, one array entry per lane */
+   int base[WG_LANES];   /* start of the lane's delay line in line[] */
+   int pos[WG_LANES];    /* write position, wrapped with WG_MASK */
+   int length[WG_LANES]; /* integer delay */
+   float tune[WG_LANES], tune_x[WG_LANES], tune_y[WG_LANES];
+   float loss_gain[WG_LANES], loss_pole[WG_LANES], loss_y[WG_LANES];
+   float disp[WG_LANES], disp_x[WG_LANES], disp_y[WG_LANES];
+   float *line;          /* all delay lines */
+} __attribute__((aligned(32)));
+extern void waveguide_start(struct voice *v, const struct tuning *t);
+extern void waveguide_render_group(struct voice **v, int n, float *bus, int stride, int count);
+
+/* additive.c */
+extern void additive_start(struct voice *v, const struct tuning *t);
+extern int additive_render(struct voice *v, float *out, int count);
+
+/* wavetable.c */
+extern void wavetable_init(unsigned int rate);
+extern void wavetable_start(struct voice *v, const struct tuning *t);
+extern void wavetable_retune(struct voice *v, const struct tuning *t);
+extern int wavetable_render(struct voice *v, float *out, int count);
+
+/* wav.c */
+/* the little-endian 16 or 24-bit sample at p */
+#define S16(p) ((short)((p)[0] | ((p)[1] << 8)))
+#define S24(p) ((int)(((p)[0] << 8) | ((p)[1] << 16) | ((unsigned int)(p)[2] << 24)) >> 8)
+struct pack_block;
+struct sample_t {
+   const unsigned char *wave_data; /* little-endian PCM frames, in the arena or map */
+   unsigned int wave_size;         /* number of frames */
+   unsigned int head_size;         /* frames at wave_data, all unless streamed or packed */
+   unsigned short channels;
+   unsigned short sample_bits;     /* 16 or 24 */
+   unsigned int sample_rate;
+   int root;                       /* MIDI note it was recorded at */
+   void *map;                      /* the whole mapped file, unless copied to the arena */
+   size_t map_size;
+   int fd;                         /* open for streaming the rest, or -1 */
+   off_t data_offset;              /* file offset of the first frame */
+   const unsigned char *packed;    /* the frames compressed, see pack.c, or NULL */
+   size_t packed_size;
+   const struct pack_block *blocks;
+};
+extern void set_sample_dir(char *dir);
+extern void set_map_mode(void);
+extern const struct sample_t *get_sample(int note, int velocity);
+extern void samples_init(void);
+extern void samples_cleanup(void);
+extern int wav_map(const char *filename, struct sample_t *s);
+#define WAV_MAX_DATA (0xffffffffU - 36) /* data bytes whose RIFF length still fits in 32 bits */
+extern void wav_write_header(int fd, unsigned int channels, unsigned int rate,
+                             enum sample_format format, unsigned int data_bytes);
+
+/* smf.c */
+struct smf_event {
+   double time;             /* seconds from the start of the file */
+   unsigned char type;      /* EV_NOTEON, EV_NOTEOFF or EV_SUSTAIN */
+   unsigned char channel;   /* MIDI channel (0...15) */
+   unsigned char note;
+   unsigned char velocity;
+};
+extern struct smf_event *smf_load(const char *filename, int *count);
+
+/* render.c */
+extern void set_render(char *midifile);
+extern void set_render_output(char *wavfile);
+extern void set_jobs(unsigned int j);
+extern int render_pending(void);
+extern void render(void);
+
+/* resample.c */
+#define RS_TAPS   32                /* filter length, a multiple of 8 */
+#define RS_PHASE_BITS 9
+#define RS_PHASES (1 << RS_PHASE_BITS) /* fractional positions in a bank */
+#define RS_BANKS  7                 /* cutoffs, a whole tone apart from pitch ratio 1 to 2 */
+extern float resample_bank[RS_BANKS][RS_PHASES][RS_TAPS];
+extern const float *resample_pick(double ratio);
+extern void resample_init(void);
+
+/* fft.c */
+struct fft {
+   int n;                /* real frames, a power of two */
+   int *rev;             /* bit reversal of the n/2 complex points */
+   float *wr, *wi;       /* twiddles of the n/2 point complex FFT */
+   float *tr, *ti;       /* e^(-2 pi i k / n), to split and join the halves */
+   float *zr, *zi;       /* scratch, so one struct fft serves one thread */
+};
+extern void fft_init(struct fft *f, int n);
+extern void fft_forward(const struct fft *f, const float *in, float *re, float *im);
+extern void fft_inverse(const struct fft *f, const float *re, const float *im, float *out);
+
+/* reverb.c */
+#define REVERB_MINBLOCK 32 /* frames, the shortest period the reverb runs with */
+extern void set_impulse(char *filename);
+extern int reverb_enabled(void);
+extern unsigned long reverb_latency(void);
+extern unsigned long reverb_late(void);
+extern int reverb_ringing(void);
+extern unsigned long reverb_tail(void);
+extern void reverb_process(float *bus, int stride, int count);
+extern void reverb_init(unsigned long max_block);
+
+/* sampler.c */
+extern void sampler_start(struct voice *v, const struct tuning *t);
+extern void sampler_retune(struct voice *v, const struct tuning *t);
+extern int sampler_render(struct voice *v, float *out, int count);
+extern void sampler_stop(struct voice *v);
+
+/* stream.c */
+extern void set_stream_mode(void);
+extern void set_head_time(unsigned int ms);
+extern int stream_enabled(void);
+extern unsigned int stream_head_frames(unsigned int sample_rate);
+extern unsigned long stream_underruns(void);
+extern void stream_start(struct voice *v);
+extern void stream_stop(struct voice *v);
+extern const unsigned char *stream_frames(struct voice *v, unsigned int pos, int *count);
+extern void stream_consumed(struct voice *v, unsigned int pos);
+extern void streams_init(void);
+extern void streams_cleanup(void);
+
+/* pack.c */
+extern void set_pack_mode(void);
+extern int pack_enabled(void);
+extern size_t pack_sample(struct sample_t *s);
+extern size_t pack_move(struct sample_t *s, unsigned char *to);
+extern void pack_start(struct voice *v);
+extern const unsigned char *pack_frames(struct voice *v, unsigned int pos, int *count);
@@ -0,0 +1,316 @@
+/*
+ *  render.c  offline MIDI file to WAV renderer of Piano.
+ *
+ *  Copyright (C) 2008 Tigran Aivazian <tigran@bibles.org.uk>
+ *
+ *  Runs the same voices and kernels as live playback, but with no audio
+ *  device and no waiting: events are applied on their exact frame and
+ *  blocks are rendered back to back as fast as the CPU allows.
+ *
+ *  When many voices sound at once, 'jobs' threads share them out.  Each
+ *  thread owns a range of voice chunks and takes work from its front;
+ *  once that is empty it steals from the back of the others' ranges.
+ *  Every chunk mixes into its own buffer and the buffers are summed in
+ *  chunk order, so the output is bit-identical for any number of threads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "piano.h"
+
+#define RENDER_BLOCK 1024 /* frames rendered per write() */
+#define RENDER_TAIL  10   /* seconds to let voices ring on after the last event */
+#define MAXCHUNKS POLYPHONY /* a chunk can be a single voice */
+#define MIN_PARALLEL_FRAMES 64 /* shorter stretches aren't worth waking threads for */
+
+static char *render_in, *render_out;
+static unsigned int jobs; /* render threads including the main one, 0 = one per CPU */
+
+/* every chunk's own mix, a plane of RENDER_BLOCK frames per channel */
+static float chunk_mix[MAXCHUNKS][MAXCHANNELS * RENDER_BLOCK] __attribute__((aligned(32)));
+
+/* range of chunks a thread has left, packed as lo << 32 | hi */
+static unsigned long long ranges[MAXJOBS];
+
+static struct {
+   pthread_mutex_t lock;
+   pthread_cond_t start, done;
+   unsigned int gen;    /* bumped to hand out a new stretch of frames */
+   unsigned int busy;   /* helper threads still working on it */
+   int count;           /* frames in the stretch */
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0 };
+
+void set_jobs(unsigned int j)
+{
+   if (j < MINJOBS || j > MAXJOBS) {
+      fprintf(stderr, "piano: invalid number of jobs = %u, must be within [%u...%u]\n", j, MINJOBS, MAXJOBS);
+      exit(1);
+   } else
+      jobs = j;
+}
+
+void set_render(char *midifile)
+{
+   render_in = strdup(midifile);
+}
+
+/* the output file name follows the MIDI file name on the command line */
+void set_render_output(char *wavfile)
+{
+   render_out = strdup(wavfile);
+}
+
+int render_pending(void)
+{
+   return render_in != NULL;
+}
+
+/* pop a chunk off the front of thread t's own range, -1 if it is empty */
+static int take_chunk(int t)
+{
+   unsigned long long r = __atomic_load_n(&ranges[t], __ATOMIC_ACQUIRE);
+   unsigned int lo, hi;
+
+   do {
+      lo = r >> 32;
+      hi = (unsigned int)r;
+      if (lo >= hi)
+         return -1;
+   } while (!__atomic_compare_exchange_n(&ranges[t], &r, (unsigned long long)(lo + 1) << 32 | hi,
+                                         0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+   return lo;
+}
+
+/* steal a chunk off the back of another thread's range, -1 if all are empty */
+static int steal_chunk(int t)
+{
+   unsigned long long r;
+   unsigned int lo, hi, i, victim;
+
+   for (i = 1; i < jobs; i++) {
+      victim = (t + i) % jobs;
+      r = __atomic_load_n(&ranges[victim], __ATOMIC_ACQUIRE);
+      do {
+         lo = r >> 32;
+         hi = (unsigned int)r;
+         if (lo >= hi)
+            break;
+      } while (!__atomic_compare_exchange_n(&ranges[victim], &r, (unsigned long long)lo << 32 | (hi - 1),
+                                            0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+      if (lo < hi)
+         return hi - 1;
+   }
+   return -1;
+}
+
+static void run_chunks(int t, int count)
+{
+   int c;
+
+   while ((c = take_chunk(t)) >= 0 || (c = steal_chunk(t)) >= 0)
+      voices_render_chunk(c, chunk_mix[c], RENDER_BLOCK, count);
+}
+
+static void *render_thread(void *arg)
+{
+   int t = (long)arg;
+   unsigned int gen = 0;
+   int count;
+
+   while (1) {
+      pthread_mutex_lock(&pool.lock);
+      while (pool.gen == gen)
+         pthread_cond_wait(&pool.start, &pool.lock);
+      gen = pool.gen;
+      count = pool.count;
+      pthread_mutex_unlock(&pool.lock);
+
+      run_chunks(t, count);
+
+      pthread_mutex_lock(&pool.lock);
+      if (--pool.busy == 0)
+         pthread_cond_signal(&pool.done);
+      pthread_mutex_unlock(&pool.lock);
+   }
+   return 0;
+}
+
+static void start_threads(void)
+{
+   pthread_t thrid;
+   long t;
+   int err;
+
+   if (!jobs)
+      jobs = sysconf(_SC_NPROCESSORS_ONLN);
+   if (jobs < MINJOBS)
+      jobs = MINJOBS;
+   else if (jobs > MAXJOBS)
+      jobs = MAXJOBS;
+   for (t = 1; t < jobs; t++) {
+      err = pthread_create(&thrid, NULL, render_thread, (void *)t);
+      if (err) {
+         fprintf(stderr, "%s: Error creating render thread: %s\n", __func__, strerror(err));
+         exit(1);
+      }
+      pthread_detach(thrid);
+   }
+}
+
+/*
+ * Mix count frames of every active voice into the channel planes of out,
+ * RENDER_BLOCK floats apart, spreading chunks over the threads.
+ */
+static void render_voices(float *out, int count)
+{
+   int nchunks = voices_chunks(), channels = get_channels(), c, chn, n;
+   float *dst;
+   const float *src;
+   unsigned int t, lo, hi;
+   int parallel = jobs > 1 && nchunks > 1 && count >= MIN_PARALLEL_FRAMES;
+
+   /* deal the chunks out in contiguous ranges */
+   for (t = 0; t < jobs; t++) {
+      lo = parallel ? nchunks * t / jobs : (t ? nchunks : 0);
+      hi = parallel ? nchunks * (t + 1) / jobs : nchunks;
+      ranges[t] = (unsigned long long)lo << 32 | hi;
+   }
+
+   if (parallel) {
+      pthread_mutex_lock(&pool.lock);
+      pool.count = count;
+      pool.busy = jobs - 1;
+      pool.gen++;
+      pthread_cond_broadcast(&pool.start);
+      pthread_mutex_unlock(&pool.lock);
+   }
+   run_chunks(0, count);
+   if (parallel) {
+      pthread_mutex_lock(&pool.lock);
+      while (pool.busy)
+         pthread_cond_wait(&pool.done, &pool.lock);
+      pthread_mutex_unlock(&pool.lock);
+   }
+
+   /* the reduction always adds the chunks in the same order */
+   for (chn = 0; chn < channels; chn++) {
+      dst = out + chn * RENDER_BLOCK;
+      memset(dst, 0, count * sizeof(float));
+      for (c = 0; c < nchunks; c++) {
+         src = chunk_mix[c] + chn * RENDER_BLOCK;
+         for (n = 0; n < count; n++)
+            dst[n] += src[n];
+      }
+   }
+   voices_reap();
+}
+
+static void apply_event(const struct smf_event *ev)
+{
+   if (!midichan_accepts(ev->channel))
+      return;
+   switch (ev->type) {
+      case EV_NOTEON:
+         voice_on(ev->note, ev->velocity);
+         break;
+      case EV_NOTEOFF:
+         voice_off(ev->note);
+         break;
+      case EV_SUSTAIN:
+         voice_sustain(ev->velocity);
+         break;
+   }
+}
+
+void render(void)
+{
+   struct smf_event *events;
+   int nevents, next = 0, fd, done, frame, count;
+   unsigned int rate = get_rate(), channels = get_channels(), chn, bytes;
+   enum sample_format format = get_format();
+   unsigned long long pos = 0, end, ev_frame;
+   unsigned long long t0, t1;
+   static float mix[MAXCHANNELS * RENDER_BLOCK], conv[MAXCHANNELS * RENDER_BLOCK]; /* conv holds any format */
+   void *out, *in[MAXCHANNELS];
+   struct dither dither;
+   size_t size;
+   double seconds;
+
+   if (!render_out) {
+      fprintf(stderr, "piano: --render needs an output WAV file name\n");
+      exit(1);
+   }
+
+   events = smf_load(render_in, &nevents);
+   reverb_init(RENDER_BLOCK);
+   end = (nevents ? events[nevents - 1].time * rate : 0) + (unsigned long long)RENDER_TAIL * rate + reverb_tail();
+
+   fd = open(render_out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (fd == -1) {
+      fprintf(stderr, "%s: open(\"%s\"): %s\n", __func__, render_out, strerror(errno));
+      exit(1);
+   }
+   /* 16-bit unless asked otherwise, it is what everything reads */
+   if (format == FMT_AUTO)
+      format = FMT_S16;
+   bytes = format_bits[format] / 8;
+   wav_write_header(fd, channels, rate, format, 0); /* sizes are patched at the end */
+
+   out = malloc(RENDER_BLOCK * channels * bytes);
+   if (!out) {
+      fprintf(stderr, "%s: Can't malloc memory for output\n", __func__);
+      exit(1);
+   }
+   for (chn = 0; chn < channels; chn++)
+      in[chn] = conv + chn * RENDER_BLOCK;
+   dither_init(&dither);
+
+   start_threads();
+   if (verbose)
+      fprintf(stderr, "Rendering with %u threads\n", jobs);
+
+   t0 = now_ns();
+   while (pos < end && (next < nevents || voices_active() || reverb_ringing())) {
+      count = RENDER_BLOCK;
+      if (count > end - pos)
+         count = end - pos;
+
+      /* split the block at every event inside it */
+      done = 0;
+      while (next < nevents && (ev_frame = events[next].time * rate + 0.5) < pos + count) {
+         frame = (ev_frame > pos) ? ev_frame - pos : 0;
+         if (frame > done) {
+            render_voices(mix + done, frame - done);
+            done = frame;
+         }
+         apply_event(&events[next++]);
+      }
+      render_voices(mix + done, count - done);
+      reverb_process(mix, RENDER_BLOCK, count);
+
+      for (chn = 0; chn < channels; chn++)
+         convert(format, in[chn], mix + chn * RENDER_BLOCK, count, &dither);
+      kernels.interleave(out, in, channels, count, bytes);
+      size = (size_t)count * channels * bytes;
+      if (write(fd, out, size) != (ssize_t)size) {
+         fprintf(stderr, "%s: write(\"%s\"): %s\n", __func__, render_out, strerror(errno));
+         exit(1);
+      }
+      pos += count;
+   }
+   t1 = now_ns();
+
+   wav_write_header(fd, channels, rate, format, pos * channels * bytes);
+   close(fd);
+   free(out);
+   free(events);
+
+   seconds = (double)pos / rate;
+   printf("%s: %.2fs of audio in %.3fs, %.1fx realtime\n", render_out,
+      seconds, (t1 - t0) / 1e9, seconds / ((t1 - t0) / 1e9));
+}
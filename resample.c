@@ -0,0 +1,82 @@
+/*
+ *  resample.c  polyphase windowed-sinc filter bank of Piano.
+ *
+ *  Copyright (C) 2008 Tigran Aivazian <tigran@bibles.org.uk>
+ *
+ *  Row p of a bank holds the RS_TAPS coefficients that interpolate a
+ *  signal at a fractional position of p / RS_PHASES past a sample frame.
+ *  There are RS_BANKS of them with the cutoff lowered in steps up to an
+ *  octave, and each voice takes the one for its own pitch ratio, so
+ *  shifting a sample up does not fold its top octave back down as aliases
+ *  while keys played near their recorded pitch keep all of theirs.
+ */
+
+#include <stdio.h>
+#include <math.h>
+#include "piano.h"
+
+#define KAISER_BETA 8.6 /* about 90dB stopband */
+
+/* aligned so every row can be loaded with aligned vector moves */
+float resample_bank[RS_BANKS][RS_PHASES][RS_TAPS] __attribute__((aligned(32)));
+
+/* the largest ratio each bank is made for, from 1 up to 2 in equal steps of pitch */
+static double bank_ratio[RS_BANKS];
+
+/* zeroth order modified Bessel function of the first kind */
+static double bessel_i0(double x)
+{
+   double sum = 1.0, term = 1.0;
+   int k;
+
+   for (k = 1; k < 32; k++) {
+      term *= (x / (2 * k)) * (x / (2 * k));
+      sum += term;
+   }
+   return sum;
+}
+
+/*
+ * The bank for a voice reading ratio source frames per frame played,
+ * the first that cuts low enough; beyond an octave up we'd rather alias
+ * a little than muffle the key.
+ */
+const float *resample_pick(double ratio)
+{
+   int b;
+
+   for (b = 0; b < RS_BANKS - 1 && ratio > bank_ratio[b]; b++)
+      ;
+   return resample_bank[b][0];
+}
+
+void resample_init(void)
+{
+   const double half = RS_TAPS / 2;
+   double fc, d, h, w, sum;
+   int b, p, k;
+
+   for (b = 0; b < RS_BANKS; b++) {
+      bank_ratio[b] = pow(2.0, (double)b / (RS_BANKS - 1));
+      /* cutoff as a fraction of the source rate, 0.5 being its Nyquist */
+      fc = 0.45 / bank_ratio[b];
+      for (p = 0; p < RS_PHASES; p++) {
+         sum = 0;
+         for (k = 0; k < RS_TAPS; k++) {
+            /* distance from the interpolated point to tap k */
+            d = k - (half - 1) - (double)p / RS_PHASES;
+            h = (d == 0) ? 2 * fc : sin(2 * M_PI * fc * d) / (M_PI * d);
+            w = (fabs(d) >= half) ? 0 : bessel_i0(KAISER_BETA * sqrt(1 - (d / half) * (d / half))) / bessel_i0(KAISER_BETA);
+            resample_bank[b][p][k] = h * w;
+            sum += h * w;
+         }
+         /* unity gain at DC for every phase */
+         for (k = 0; k < RS_TAPS; k++)
+            resample_bank[b][p][k] /= sum;
+      }
+   }
+
+   if (verbose)
+      fprintf(stderr, "Resampler: %d taps, %d phases, %d banks cutting at %.3f...%.3f of source rate\n",
+         RS_TAPS, RS_PHASES, RS_BANKS, 0.45 / bank_ratio[RS_BANKS - 1], 0.45);
+}
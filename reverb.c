@@ -0,0 +1,343 @@
+/*
+ *  reverb.c  convolution reverb of Piano.
+ *
+ *  Copyright (C) 2008 Tigran Aivazian <tigran@bibles.org.uk>
+ *
+ *  The master bus is convolved with the impulse response of a soundboard
+ *  or a room, read from a WAV file.  The response is cut into partitions
+ *  of 'block' frames, each kept as the spectrum of a 2 * block FFT, and
+ *  every block of input is transformed once into a frequency domain delay
+ *  line.  A block of output is the sum over the partitions of each one's
+ *  spectrum times the input spectrum as many blocks old as the partition
+ *  is late in the response, transformed back with the overlap-save trick.
+ *  However long the response, that adds just 'block' frames of latency.
+ *  The block is the largest power of two that fits in a period, so the
+ *  added latency stays within one period; periods shorter than
+ *  REVERB_MINBLOCK frames are refused rather than exceeded.
+ *
+ *  Only the first REVERB_HEAD partitions need the block that just came
+ *  in, so the audio thread does those and a worker thread sums all the
+ *  later ones REVERB_HEAD blocks ahead of time.  Should the worker ever
+ *  fall behind, the block plays without its tail rather than the audio
+ *  thread waiting for it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <semaphore.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "piano.h"
+
+#define REVERB_HEAD   4   /* partitions summed in the audio thread */
+
+struct conv {
+   float *ir_re, *ir_im;   /* spectra of the partitions of the response */
+   float *fdl_re, *fdl_im; /* spectra of the last 'parts' blocks of input */
+   float *tail_re[REVERB_HEAD], *tail_im[REVERB_HEAD]; /* worker's sums, by block */
+   float *in;              /* the last two blocks of input */
+   float *out;             /* the block of output being played */
+};
+
+static char *impulse_file;
+static unsigned int channels;
+static int block;             /* frames per partition, a power of two */
+static int bins;              /* spectrum length padded to a multiple of 8 */
+static int parts;             /* partitions in the response */
+static unsigned long length;  /* frames in the response */
+static struct fft fft;
+static struct conv conv[MAXCHANNELS];
+static float *yr, *yi, *frames; /* audio thread scratch */
+static int fill;              /* frames of the current block in and out */
+static unsigned long quiet;   /* blocks of silent input in a row */
+static int offline;           /* wait for the worker, there is no deadline */
+
+static unsigned long blocks;  /* blocks done by the audio thread */
+static unsigned long posted;  /* the last block the worker may sum a tail for */
+static unsigned long done;    /* the last block the worker has summed a tail for */
+static unsigned long late;    /* blocks played without their tail */
+static sem_t work, ready;
+static pthread_t reverb_thrid;
+
+void set_impulse(char *filename)
+{
+   impulse_file = strdup(filename);
+}
+
+int reverb_enabled(void)
+{
+   return parts > 0;
+}
+
+/* frames the reverb delays the bus by */
+unsigned long reverb_latency(void)
+{
+   return reverb_enabled() ? block : 0;
+}
+
+unsigned long reverb_late(void)
+{
+   return __atomic_load_n(&late, __ATOMIC_RELAXED);
+}
+
+/* whether input that has gone quiet is still coming out */
+int reverb_ringing(void)
+{
+   return reverb_enabled() && quiet < (unsigned long)parts + 2;
+}
+
+/* frames the output goes on for after the input stops */
+unsigned long reverb_tail(void)
+{
+   return reverb_enabled() ? (unsigned long)(parts + 2) * block : 0;
+}
+
+static float *reverb_alloc(size_t count)
+{
+   void *p;
+
+   if (posix_memalign(&p, 32, count * sizeof(float))) {
+      fprintf(stderr, "%s: Can't malloc memory for the reverb\n", __func__);
+      exit(1);
+   }
+   memset(p, 0, count * sizeof(float));
+   return p;
+}
+
+/* the delay line slot holding the input of block k - m */
+static inline int slot_of(unsigned long k, int m)
+{
+   return (k % parts + parts - m) % parts;
+}
+
+/* sum partitions from...parts-1 of block k's output spectrum into re, im */
+static void sum_partitions(const struct conv *p, unsigned long k, int from, float *re, float *im)
+{
+   int m, s;
+
+   for (m = from; m < parts; m++) {
+      s = slot_of(k, m);
+      kernels.cmac(re, im, p->ir_re + m * bins, p->ir_im + m * bins,
+                   p->fdl_re + s * bins, p->fdl_im + s * bins, bins);
+   }
+}
+
+static void *reverb_thread(void *arg ATTRIBUTE_UNUSED)
+{
+   unsigned long j;
+   unsigned int c;
+   int slot;
+
+   while (!stop_pending()) {
+      while (sem_wait(&work) == -1 && errno == EINTR)
+         ;
+      while ((j = done + 1) <= __atomic_load_n(&posted, __ATOMIC_ACQUIRE)) {
+         /* a block the audio thread has already played is not worth summing */
+         if (j >= __atomic_load_n(&blocks, __ATOMIC_ACQUIRE)) {
+            slot = j % REVERB_HEAD;
+            for (c = 0; c < channels; c++) {
+               memset(conv[c].tail_re[slot], 0, bins * sizeof(float));
+               memset(conv[c].tail_im[slot], 0, bins * sizeof(float));
+               sum_partitions(&conv[c], j, REVERB_HEAD, conv[c].tail_re[slot], conv[c].tail_im[slot]);
+            }
+         }
+         __atomic_store_n(&done, j, __ATOMIC_RELEASE);
+         if (offline)
+            sem_post(&ready);
+      }
+   }
+   return 0;
+}
+
+/* transform the block that just filled up and work out the next one to play */
+static void run_block(void)
+{
+   unsigned long k = blocks;
+   int slot = k % REVERB_HEAD, head = (parts < REVERB_HEAD) ? parts : REVERB_HEAD;
+   int tail = parts > REVERB_HEAD, silent = 1, n;
+   unsigned int c;
+   struct conv *p;
+
+   if (tail) {
+      while (offline && __atomic_load_n(&done, __ATOMIC_ACQUIRE) < k)
+         while (sem_wait(&ready) == -1 && errno == EINTR)
+            ;
+      if (__atomic_load_n(&done, __ATOMIC_ACQUIRE) < k) {
+         __atomic_fetch_add(&late, 1, __ATOMIC_RELAXED);
+         tail = 0;
+      }
+   }
+
+   for (c = 0; c < channels; c++) {
+      p = &conv[c];
+      for (n = block; n < 2 * block && silent; n++)
+         silent = (p->in[n] == 0);
+      fft_forward(&fft, p->in, p->fdl_re + k % parts * bins, p->fdl_im + k % parts * bins);
+      if (tail) {
+         memcpy(yr, p->tail_re[slot], bins * sizeof(float));
+         memcpy(yi, p->tail_im[slot], bins * sizeof(float));
+      } else {
+         memset(yr, 0, bins * sizeof(float));
+         memset(yi, 0, bins * sizeof(float));
+      }
+      for (n = 0; n < head; n++)
+         kernels.cmac(yr, yi, p->ir_re + n * bins, p->ir_im + n * bins,
+                      p->fdl_re + slot_of(k, n) * bins, p->fdl_im + slot_of(k, n) * bins, bins);
+      /* the first half wrapped around, the second half is the linear convolution */
+      fft_inverse(&fft, yr, yi, frames);
+      memcpy(p->out, frames + block, block * sizeof(float));
+      memmove(p->in, p->in + block, block * sizeof(float));
+   }
+   quiet = silent ? quiet + 1 : 0;
+
+   __atomic_store_n(&blocks, k + 1, __ATOMIC_RELEASE);
+   if (parts > REVERB_HEAD) {
+      __atomic_store_n(&posted, k + REVERB_HEAD, __ATOMIC_RELEASE);
+      sem_post(&work);
+   }
+}
+
+/*
+ * Replace count frames of each of the channel planes, stride floats apart
+ * in bus, by the reverb's output.  Any count will do, frames go in and
+ * come out a block at a time.
+ */
+void reverb_process(float *bus, int stride, int count)
+{
+   unsigned int c;
+   float *x;
+   int pos, n;
+
+   if (!reverb_enabled())
+      return;
+
+   for (pos = 0; pos < count; pos += n) {
+      n = (count - pos < block - fill) ? count - pos : block - fill;
+      for (c = 0; c < channels; c++) {
+         x = bus + c * stride + pos;
+         memcpy(conv[c].in + block + fill, x, n * sizeof(float));
+         memcpy(x, conv[c].out + fill, n * sizeof(float));
+      }
+      fill += n;
+      if (fill == block) {
+         run_block();
+         fill = 0;
+      }
+   }
+}
+
+/* read channel c of the response into ir, stretched from ir_rate to rate */
+static void load_channel(const struct sample_t *s, int c, float *ir, unsigned int rate)
+{
+   unsigned int fb = s->channels * (s->sample_bits / 8), i0;
+   double step = (double)s->sample_rate / rate, x, f, a, b;
+   const unsigned char *p;
+   unsigned long n;
+
+   for (n = 0; n < length; n++) {
+      /* linear interpolation is plenty for a reverb tail, it has no tone to alias */
+      x = n * step;
+      i0 = x;
+      f = x - i0;
+      p = s->wave_data + (size_t)i0 * fb + c * (s->sample_bits / 8);
+      a = (s->sample_bits == 16) ? S16(p) / 32768.0 : S24(p) / 8388608.0;
+      b = a;
+      if (i0 + 1 < s->wave_size)
+         b = (s->sample_bits == 16) ? S16(p + fb) / 32768.0 : S24(p + fb) / 8388608.0;
+      ir[n] = a + f * (b - a);
+   }
+}
+
+/* block frames of latency at most, a power of two from REVERB_MINBLOCK up */
+void reverb_init(unsigned long max_block)
+{
+   struct sample_t s;
+   unsigned int rate = get_rate(), ir_channels, c, i;
+   float *ir[2], *part;
+   double energy, peak = 0;
+   unsigned long n;
+   int m, err;
+
+   if (!impulse_file)
+      return;
+   if (wav_map(impulse_file, &s) < 0) {
+      fprintf(stderr, "%s: can't load the impulse response \"%s\"\n", __func__, impulse_file);
+      exit(1);
+   }
+
+   if (max_block < REVERB_MINBLOCK) {
+      fprintf(stderr, "piano: the impulse response needs periods of at least %d frames, not %lu\n",
+         REVERB_MINBLOCK, max_block);
+      exit(1);
+   }
+   channels = get_channels();
+   offline = render_pending();
+   for (block = REVERB_MINBLOCK; (unsigned long)block * 2 <= max_block; block *= 2)
+      ;
+   bins = (block + 1 + 7) / 8 * 8;
+   length = (unsigned long long)s.wave_size * rate / s.sample_rate;
+   if (length < 1)
+      length = 1;
+   parts = (length + block - 1) / block;
+
+   /* one response per channel, or the stereo pair over and over */
+   ir_channels = s.channels;
+   for (i = 0; i < ir_channels; i++) {
+      ir[i] = reverb_alloc(parts * block);
+      load_channel(&s, i, ir[i], rate);
+      for (energy = 0, n = 0; n < length; n++)
+         energy += ir[i][n] * ir[i][n];
+      if (energy > peak)
+         peak = energy;
+   }
+   munmap(s.map, s.map_size);
+
+   /* unit energy in the loudest channel keeps the level of a broadband mix */
+   for (i = 0; i < ir_channels; i++)
+      for (n = 0; peak > 0 && n < length; n++)
+         ir[i][n] /= sqrt(peak);
+
+   fft_init(&fft, 2 * block);
+   yr = reverb_alloc(bins);
+   yi = reverb_alloc(bins);
+   frames = reverb_alloc(2 * block);
+   part = reverb_alloc(2 * block); /* a partition, padded with zeros */
+   for (c = 0; c < channels; c++) {
+      conv[c].ir_re = reverb_alloc(parts * bins);
+      conv[c].ir_im = reverb_alloc(parts * bins);
+      conv[c].fdl_re = reverb_alloc(parts * bins);
+      conv[c].fdl_im = reverb_alloc(parts * bins);
+      for (m = 0; m < REVERB_HEAD; m++) {
+         conv[c].tail_re[m] = reverb_alloc(bins);
+         conv[c].tail_im[m] = reverb_alloc(bins);
+      }
+      conv[c].in = reverb_alloc(2 * block);
+      conv[c].out = reverb_alloc(block);
+      for (m = 0; m < parts; m++) {
+         memcpy(part, ir[c % ir_channels] + m * block, block * sizeof(float));
+         fft_forward(&fft, part, conv[c].ir_re + m * bins, conv[c].ir_im + m * bins);
+      }
+   }
+   free(part);
+   for (i = 0; i < ir_channels; i++)
+      free(ir[i]);
+
+   /* the tails of the first REVERB_HEAD blocks are silence */
+   done = posted = REVERB_HEAD - 1;
+   quiet = parts + 2;
+   if (parts > REVERB_HEAD) {
+      sem_init(&work, 0, 0);
+      sem_init(&ready, 0, 0);
+      err = pthread_create(&reverb_thrid, NULL, reverb_thread, NULL);
+      if (err) {
+         fprintf(stderr, "%s: Error creating reverb thread: %s\n", __func__, strerror(err));
+         exit(1);
+      }
+   }
+   if (verbose)
+      fprintf(stderr, "Reverb: %.2fs impulse response in %d partitions of %d frames\n",
+         (double)length / rate, parts, block);
+}
@@ -0,0 +1,163 @@
+/*
+ *  sampler.c  sample playback engine of Piano.
+ *
+ *  Copyright (C) 2008 Tigran Aivazian <tigran@bibles.org.uk>
+ *
+ *  A key without a sample of its own plays the nearest recorded one at a
+ *  different speed.  Such voices decode their sample into a short float
+ *  history and interpolate it with a polyphase sinc bank from resample.c.
+ *  Voices that play a sample at its own pitch and rate skip all that.
+ *  Frames come from the sample's mapping, the arena, a streamed ring or, with
+ *  --compress, the voice's ring of frames decoded by pack.c.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "piano.h"
+
+#define HIST_SIZE 256                /* frames of decoded history per voice */
+#define HIST_BEFORE (RS_TAPS / 2 - 1) /* taps before the play position */
+#define UNITY (1ULL << 32)           /* a sample_step of 1.0 */
+
+static float history[POLYPHONY][HIST_SIZE] __attribute__((aligned(32)));
+
+void sampler_retune(struct voice *v, const struct tuning *t)
+{
+   const struct sample_t *s = v->sample;
+   double ratio;
+
+   if (!s)
+      return;
+   /* the sample sounds at its key's equal tempered pitch, whatever t is */
+   ratio = t->step[v->note] * s->sample_rate / get_equal_tuning()->freq[s->root];
+   if (ratio > RS_TAPS / 2)
+      ratio = RS_TAPS / 2; /* the history window can't skip more than this */
+   v->sample_step = ratio * UNITY + 0.5;
+   v->bank = resample_pick(ratio);
+}
+
+void sampler_start(struct voice *v, const struct tuning *t)
+{
+   const struct sample_t *s = get_sample(v->note, v->velocity);
+
+   v->sample = s;
+   v->sample_pos = 0;
+   if (!s)
+      return;
+
+   sampler_retune(v, t);
+
+   /* the history starts with the silence before the first frame */
+   memset(history[v->id], 0, HIST_BEFORE * sizeof(float));
+   v->hist_len = HIST_BEFORE;
+   v->hist_pos = (unsigned long long)HIST_BEFORE << 32;
+
+   if (s->packed)
+      pack_start(v);
+   else if (s->head_size < s->wave_size)
+      stream_start(v);
+}
+
+void sampler_stop(struct voice *v)
+{
+   if (v->sample && !v->sample->packed && v->sample->head_size < v->sample->wave_size)
+      stream_stop(v);
+}
+
+/* add count frames at p to out, downmixed to mono */
+static void mix_frames(const struct sample_t *s, const unsigned char *p, float *out, int count, float amplitude)
+{
+   float gain = amplitude / ((s->sample_bits == 16) ? 32768.0f : 8388608.0f) / s->channels;
+   int n;
+
+   if (s->sample_bits == 16) {
+      if (s->channels == 1)
+         for (n = 0; n < count; n++, p += 2)
+            out[n] += gain * S16(p);
+      else
+         for (n = 0; n < count; n++, p += 4)
+            out[n] += gain * (S16(p) + S16(p + 2));
+   } else {
+      if (s->channels == 1)
+         for (n = 0; n < count; n++, p += 3)
+            out[n] += gain * S24(p);
+      else
+         for (n = 0; n < count; n++, p += 6)
+            out[n] += gain * (S24(p) + S24(p + 3));
+   }
+}
+
+/* add the next count frames of the sample to out, nothing past its end */
+static void read_source(struct voice *v, float *out, int count, float amplitude)
+{
+   const struct sample_t *s = v->sample;
+   unsigned int frame_bytes = s->channels * (s->sample_bits / 8);
+   unsigned int pos = v->sample_pos;
+   const unsigned char *p;
+   int n;
+
+   v->sample_pos += count;
+   while (count > 0 && pos < s->wave_size) {
+      n = count;
+      if (n > s->wave_size - pos)
+         n = s->wave_size - pos;
+      if (pos < s->head_size) {
+         if (n > s->head_size - pos)
+            n = s->head_size - pos;
+         p = s->wave_data + pos * frame_bytes;
+      } else if (s->packed)
+         p = pack_frames(v, pos, &n);
+      else
+         p = stream_frames(v, pos, &n); /* NULL: not read yet, play silence */
+      if (p)
+         mix_frames(s, p, out, n, amplitude);
+      out += n;
+      count -= n;
+      pos += n;
+   }
+   if (!s->packed && pos > s->head_size && pos <= s->wave_size)
+      stream_consumed(v, pos);
+}
+
+/* play at a different speed through the voice's sinc bank */
+static void resample_render(struct voice *v, float *out, int count)
+{
+   float *hist = history[v->id];
+   unsigned int ipos, phase, drop;
+   int n;
+
+   for (n = 0; n < count; n++) {
+      ipos = v->hist_pos >> 32;
+      if (ipos + RS_TAPS / 2 >= (unsigned int)v->hist_len) {
+         /* slide what the window still needs to the front, decode more */
+         drop = ipos - HIST_BEFORE;
+         v->hist_len -= drop;
+         memmove(hist, hist + drop, v->hist_len * sizeof(float));
+         v->hist_pos -= (unsigned long long)drop << 32;
+         memset(hist + v->hist_len, 0, (HIST_SIZE - v->hist_len) * sizeof(float));
+         read_source(v, hist + v->hist_len, HIST_SIZE - v->hist_len, 1.0f);
+         v->hist_len = HIST_SIZE;
+         ipos = HIST_BEFORE;
+      }
+      phase = (v->hist_pos >> (32 - RS_PHASE_BITS)) & (RS_PHASES - 1);
+      out[n] += v->amplitude * kernels.dot(hist + ipos - HIST_BEFORE, v->bank + phase * RS_TAPS, RS_TAPS);
+      v->hist_pos += v->sample_step;
+   }
+}
+
+/* add count frames to out; returns 0 once the sample ends */
+int sampler_render(struct voice *v, float *out, int count)
+{
+   const struct sample_t *s = v->sample;
+
+   if (!s)
+      return 0; /* no sample for this key */
+
+   if (v->sample_step == UNITY) {
+      read_source(v, out, count, v->amplitude);
+      return v->sample_pos < s->wave_size;
+   }
+   resample_render(v, out, count);
+   /* hist[0] holds frame sample_pos - hist_len */
+   return (long long)v->sample_pos - v->hist_len + (long long)(v->hist_pos >> 32) < s->wave_size;
+}
@@ -2,16 +2,25 @@
  *  scales.c  definitions of temperaments for Piano.
  *
  *  Copyright (C) 2008 Tigran Aivazian <tigran@bibles.org.uk>
+ *
+ *  Every temperament is a complete tuning table built once: the frequency
+ *  of each key and its phase increment at the stream rate, so starting a
+ *  note is a table lookup.  The active table is a single pointer that the
+ *  shell swaps atomically; the audio thread notices the new one at its
+ *  next block and retunes the sounding voices there.  A table that has
+ *  been active is never freed, the audio thread may still be reading it.
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
 #include <math.h>
 #include "piano.h"
 
-/* the entries 0..MINMIDINOTE are wasted */
-static struct scale et[MAXMIDINOTE+1];
-struct scale *scale;
+#define SCALA_MAX   1024       /* notes in a Scala scale */
+#define SCALA_ROOT  60         /* the key Scala scales start from, middle C */
 
 char *note_names[] = {
     "N0", "N1",   "N2",  "N3",  "N4",  "N5",  "N6",  "N7",  "N8",  "N9",  "N10", "N11",
@@ -27,27 +36,208 @@ char *note_names[] = {
     "N120","N121","N122","N123","N124","N125","N126","N127","N128",
 };
 
+/* the temperaments built in, as cents of each pitch class above C */
+static const struct temperament {
+   const char *name;
+   double cents[12];   /* C, C#, D, ... B */
+   int stretch;        /* apply the Railsback curve on top */
+} temperaments[] = {
+   { "et",           { 0, 100, 200, 300, 400, 500, 600, 700, 800, 900, 1000, 1100 }, 0 },
+   { "werckmeister", { 0, 90.225, 192.180, 294.135, 390.225, 498.045,
+                       588.270, 696.090, 792.180, 888.270, 996.090, 1092.180 }, 0 },
+   { "meantone",     { 0, 76.049, 193.157, 310.265, 386.314, 503.422,
+                       579.471, 696.578, 772.627, 889.735, 1006.843, 1082.892 }, 0 },
+   { "railsback",    { 0, 100, 200, 300, 400, 500, 600, 700, 800, 900, 1000, 1100 }, 1 },
+};
+#define NTEMPERAMENTS (sizeof(temperaments)/sizeof(temperaments[0]))
+
+static struct tuning tunings[NTEMPERAMENTS];
+static const struct tuning *tuning; /* the active one */
+static char *initial = "et";        /* from the command line */
 
-/* Equal Temperament */
-static void et_init(void)
+void set_tuning(char *name)
 {
+   initial = strdup(name);
+}
+
+const struct tuning *get_tuning(void)
+{
+   return __atomic_load_n(&tuning, __ATOMIC_ACQUIRE);
+}
+
+/* equal temperament, the pitch samples are recorded at */
+const struct tuning *get_equal_tuning(void)
+{
+   return &tunings[0];
+}
+
+/*
+ * The octave stretch of a real piano tuned to its own inharmonicity, a
+ * smooth fit of the Railsback curve: flat around A4 and some 35 cents
+ * flat in the lowest bass and sharp in the top treble.
+ */
+static double stretch_cents(int note)
+{
+   double x;
+
+   if (note >= 69) {
+      x = (note - 69) / 39.0;
+      return 5 * x + 30 * x * x * x;
+   }
+   x = (69 - note) / 48.0;
+   return -(5 * x + 30 * x * x * x);
+}
+
+/* fill in the phase increments of t's frequencies */
+static void tuning_steps(struct tuning *t)
+{
+   double per_frame = 1.0 / get_rate();
    int i;
-   double etfactor = pow(2.0, 1.0/12.0);
 
-   memset(et+MINMIDINOTE, 0, (MAXMIDINOTE-MINMIDINOTE+1)*sizeof(struct scale));
+   for (i = MINMIDINOTE; i <= MAXMIDINOTE; i++)
+      t->step[i] = t->freq[i] * per_frame;
+}
+
+/* every temperament is tuned to A4 = 440Hz */
+static void temperament_init(struct tuning *t, const struct temperament *tm)
+{
+   double cents;
+   int i, pc;
+
+   memset(t, 0, sizeof(*t));
+   snprintf(t->name, sizeof(t->name), "%s", tm->name);
+   for (i = MINMIDINOTE; i <= MAXMIDINOTE; i++) {
+      pc = i % 12;
+      cents = (i / 12 - 69 / 12) * 1200 + tm->cents[pc] - tm->cents[69 % 12];
+      if (tm->stretch)
+         cents += stretch_cents(i);
+      t->freq[i] = 440.0 * pow(2.0, cents / 1200);
+   }
+   tuning_steps(t);
+}
+
+/*
+ * A Scala pitch: cents if it has a decimal point, otherwise a ratio n/d
+ * or n.  Whatever follows it on the line is a comment.
+ */
+static int scala_pitch(const char *line, double *cents)
+{
+   double n, d = 1;
+   char *end;
 
-   for (i=MINMIDINOTE; i<MAXMIDINOTE+1; i++)
-      et[i].name = note_names[i];
+   if (memchr(line, '.', strcspn(line, " \t\r\n"))) {
+      *cents = strtod(line, &end);
+      return (end == line) ? -1 : 0;
+   }
+   n = strtod(line, &end);
+   if (end == line)
+      return -1;
+   if (*end == '/')
+      d = strtod(end + 1, NULL);
+   if (n <= 0 || d <= 0)
+      return -1;
+   *cents = 1200 * log2(n / d);
+   return 0;
+}
 
-   et[MINMIDINOTE].freq = 27.5;
-   for (i=MINMIDINOTE+1; i<MAXMIDINOTE+1; i++) {
-      et[i].freq = et[i-1].freq * etfactor;
-      /* if (verbose) fprintf(stderr, "%-4s %.3f\n", et[i].name, et[i].freq); */
+/*
+ * Load a Scala .scl file: a description, the number of notes and then
+ * their pitches above the first one, the last being the period the scale
+ * repeats at.  The first note sits on middle C at its equal temperament
+ * pitch and every key up or down is the next note of the scale.
+ */
+static struct tuning *scala_load(const char *filename)
+{
+   static double cents[SCALA_MAX + 1];
+   char line[256], *p;
+   struct tuning *t;
+   int count = -1, got = 0, lines = 0, i, deg, period;
+   FILE *f;
+
+   f = fopen(filename, "r");
+   if (!f) {
+      fprintf(stderr, "%s: fopen(\"%s\"): %s\n", __func__, filename, strerror(errno));
+      return NULL;
    }
+   while (got < count || count < 0) {
+      if (!fgets(line, sizeof(line), f))
+         break;
+      if (line[0] == '!')
+         continue;
+      if (lines++ == 0)
+         continue; /* the description */
+      for (p = line; isspace((unsigned char)*p); p++)
+         ;
+      if (count < 0) {
+         count = atoi(p);
+         if (count < 1 || count > SCALA_MAX)
+            break;
+      } else if (scala_pitch(p, &cents[++got]) < 0)
+         break;
+   }
+   fclose(f);
+   if (count < 1 || count > SCALA_MAX || got < count) {
+      fprintf(stderr, "%s: \"%s\" is not a Scala scale of 1...%d notes\n", __func__, filename, SCALA_MAX);
+      return NULL;
+   }
+
+   t = calloc(1, sizeof(*t));
+   if (!t) {
+      fprintf(stderr, "%s: Can't malloc memory for the tuning\n", __func__);
+      return NULL;
+   }
+   snprintf(t->name, sizeof(t->name), "%s", filename);
+   cents[0] = 0;
+   for (i = MINMIDINOTE; i <= MAXMIDINOTE; i++) {
+      deg = i - SCALA_ROOT;
+      period = (deg >= 0) ? deg / count : -((count - 1 - deg) / count);
+      deg -= period * count;
+      t->freq[i] = 440.0 * pow(2.0, (period * cents[count] + cents[deg] - 900) / 1200);
+   }
+   tuning_steps(t);
+   return t;
+}
+
+/* make name, a built-in temperament or a Scala file, the active tuning */
+int tuning_select(const char *name)
+{
+   const struct tuning *t = NULL;
+   unsigned int i;
+
+   for (i = 0; i < NTEMPERAMENTS; i++)
+      if (!strcmp(name, tunings[i].name))
+         t = &tunings[i];
+   if (!t)
+      t = scala_load(name);
+   if (!t)
+      return -1;
+   __atomic_store_n(&tuning, t, __ATOMIC_RELEASE);
+   return 0;
+}
+
+void tunings_print(void)
+{
+   unsigned int i;
+
+   printf("tuning: %s, built in:", get_tuning()->name);
+   for (i = 0; i < NTEMPERAMENTS; i++)
+      printf(" %s", tunings[i].name);
+   printf(", or a Scala .scl file\n");
 }
 
 void scales_init(void)
 {
-   et_init();
-   scale = et; /* make equal temperament active */
+   unsigned int i;
+
+   for (i = 0; i < NTEMPERAMENTS; i++)
+      temperament_init(&tunings[i], &temperaments[i]);
+   if (tuning_select(initial) < 0) {
+      fprintf(stderr, "piano: unknown tuning \"%s\", must be one of:", initial);
+      for (i = 0; i < NTEMPERAMENTS; i++)
+         fprintf(stderr, " %s", tunings[i].name);
+      fprintf(stderr, " or a Scala .scl file\n");
+      exit(1);
+   }
+   if (verbose)
+      fprintf(stderr, "Tuning: %s\n", tuning->name);
 }
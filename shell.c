@@ -6,6 +6,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <readline/readline.h>
 #include <readline/history.h>
@@ -31,6 +32,9 @@ void shell_init(void)
 
 static void *shell_thread(void *arg ATTRIBUTE_UNUSED)
 {
+   int percent;
+   char name[256];
+
    printf("Welcome to piano v0.1, type \"help\" if you wish.\n");
    while (1) {
       char *line = readline("> ");
@@ -43,7 +47,33 @@ static void *shell_thread(void *arg ATTRIBUTE_UNUSED)
          } else if (!strcmp("help", line) || !strcmp("?", line)) {
             printf("Available commands:\n"
                    "q - quit the piano program.\n"
+                   "stats - show performance counters.\n"
+                   "latency - show note latency percentiles.\n"
+                   "latency reset - start measuring note latency afresh.\n"
+                   "spread N - spread the keyboard over N%% of the channels.\n"
+                   "tuning - show the tuning and the temperaments built in.\n"
+                   "tuning NAME - retune to a built-in temperament or a Scala .scl file.\n"
                    "help - list available commands.\n");
+         } else if (!strcmp("stats", line)) {
+            audio_print_stats(stdout);
+            if (stream_enabled())
+               printf("stream underruns: %lu\n", stream_underruns());
+            if (reverb_enabled())
+               printf("reverb blocks without their tail: %lu\n", reverb_late());
+         } else if (!strcmp("latency", line)) {
+            latency_print();
+         } else if (!strcmp("latency reset", line)) {
+            latency_reset();
+         } else if (sscanf(line, "spread %d", &percent) == 1) {
+            if (percent >= MINSPREAD && percent <= MAXSPREAD)
+               set_spread(percent);
+            else
+               printf("Spread must be within [%d...%d].\n", MINSPREAD, MAXSPREAD);
+         } else if (!strcmp("tuning", line)) {
+            tunings_print();
+         } else if (sscanf(line, "tuning %255s", name) == 1) {
+            if (tuning_select(name) < 0)
+               printf("Unknown tuning \"%s\".\n", name);
          } else
             printf("Invalid command \"%s\".\n", line);
          free(line);
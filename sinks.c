@@ -0,0 +1,246 @@
+/*
+ *  sinks.c  null and file output backends of Piano.
+ *
+ *  Copyright (C) 2008 Tigran Aivazian <tigran@bibles.org.uk>
+ *
+ *  These let the whole MIDI to samples pipeline run without a sound card.
+ *  "null" throws periods away as fast as they are rendered, "clock" throws
+ *  them away at the pace a device running at the stream rate would play
+ *  them, and "file" writes them to a raw or, for a name ending in .wav,
+ *  a WAV file as fast as they are rendered.
+ *
+ *  The null sinks take any format and default to float like the best
+ *  device would, files default to 16-bit since everything can read that.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* ppoll() */
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include "piano.h"
+
+static unsigned int rate, channels;
+static enum sample_format format;
+static unsigned long buffer_size, period_size;
+static struct audio_area *areas; /* one period of interleaved samples */
+static int clocked;              /* play at the stream rate rather than at once */
+static int running;              /* the simulated clock is ticking */
+static unsigned long long clock_start; /* when it started, in ns */
+static unsigned long written;    /* frames handed over since the clock started */
+static int file_fd = -1;
+static int file_wav;             /* patch a WAV header on close */
+static unsigned long long file_bytes;
+static int file_full;             /* reached WAV_MAX_DATA */
+
+static void sink_open(unsigned long *buffer, unsigned long *period,
+                      enum sample_format *fmt, enum sample_format preferred)
+{
+   unsigned int chn, bits;
+   void *samples;
+
+   rate = get_rate();
+   channels = get_channels();
+   format = get_format();
+   if (format == FMT_AUTO)
+      format = preferred;
+   bits = format_bits[format];
+   period_size = (unsigned long long)rate * get_period_time() / 1000000;
+   if (period_size < 1)
+      period_size = 1;
+   /* a whole number of periods, and at least two of them like a real device */
+   buffer_size = (unsigned long long)rate * get_buffer_time() / 1000000 / period_size * period_size;
+   if (buffer_size < 2 * period_size)
+      buffer_size = 2 * period_size;
+
+   samples = malloc(period_size * channels * bits / 8);
+   areas = calloc(channels, sizeof(struct audio_area));
+   if (!samples || !areas) {
+      fprintf(stderr, "%s: Can't malloc memory for samples\n", __func__);
+      exit(1);
+   }
+   for (chn = 0; chn < channels; chn++) {
+      areas[chn].addr = samples;
+      areas[chn].first = chn * bits;
+      areas[chn].step = channels * bits;
+   }
+
+   *buffer = buffer_size;
+   *period = period_size;
+   *fmt = format;
+   if (verbose)
+      fprintf(stderr, "Output: %u channels at %uHz, %lu frame ring, %lu frame periods\n",
+         channels, rate, buffer_size, period_size);
+}
+
+static void null_open(const char *arg ATTRIBUTE_UNUSED, unsigned long *buffer, unsigned long *period,
+                      enum sample_format *fmt)
+{
+   sink_open(buffer, period, fmt, FMT_FLOAT);
+}
+
+static void clock_open(const char *arg ATTRIBUTE_UNUSED, unsigned long *buffer, unsigned long *period,
+                       enum sample_format *fmt)
+{
+   clocked = 1;
+   sink_open(buffer, period, fmt, FMT_FLOAT);
+}
+
+static void file_open(const char *arg, unsigned long *buffer, unsigned long *period,
+                      enum sample_format *fmt)
+{
+   size_t len;
+
+   if (!arg || !*arg) {
+      fprintf(stderr, "piano: the file output needs a name: -o file:out.wav\n");
+      exit(1);
+   }
+   sink_open(buffer, period, fmt, FMT_S16);
+
+   file_fd = open(arg, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (file_fd == -1) {
+      fprintf(stderr, "%s: open(\"%s\"): %s\n", __func__, arg, strerror(errno));
+      exit(1);
+   }
+   len = strlen(arg);
+   file_wav = len > 4 && !strcasecmp(arg + len - 4, ".wav");
+   if (file_wav)
+      wav_write_header(file_fd, channels, rate, format, 0);
+}
+
+/* frames played since the clock started */
+static unsigned long played(void)
+{
+   if (!running)
+      return 0;
+   return (now_ns() - clock_start) * rate / 1000000000ULL;
+}
+
+static long sink_avail(void)
+{
+   unsigned long p;
+
+   if (!clocked)
+      return buffer_size - written;
+   p = played();
+   if (p > written) {
+      /* the simulated device ran dry, restart it like an underrun would */
+      audio_count_xrun(0, now_ns());
+      running = 0;
+      written = 0;
+      p = 0;
+   }
+   return buffer_size - (written - p);
+}
+
+/* without a clock the ring is played the instant we look away */
+static void sink_wait(int wakeup_fd)
+{
+   struct pollfd wakeup = { wakeup_fd, POLLIN, 0 };
+   unsigned long long ns;
+   struct timespec ts;
+   long need;
+
+   if (!clocked) {
+      written = 0;
+      return;
+   }
+   need = period_size - sink_avail();
+   if (need <= 0 || !running)
+      return;
+   ns = (unsigned long long)need * 1000000000ULL / rate;
+   ts.tv_sec = ns / 1000000000ULL;
+   ts.tv_nsec = ns % 1000000000ULL;
+   ppoll(&wakeup, 1, &ts, NULL);
+}
+
+static long sink_delay(void)
+{
+   return buffer_size - sink_avail();
+}
+
+static int sink_begin(const struct audio_area **my_areas, unsigned long *offset, unsigned long *frames)
+{
+   if (*frames > period_size)
+      *frames = period_size;
+   *offset = 0;
+   *my_areas = areas;
+   return 0;
+}
+
+static int sink_commit(unsigned long offset ATTRIBUTE_UNUSED, unsigned long frames)
+{
+   const char *p = areas[0].addr;
+   size_t frame_bytes = channels * format_bits[format] / 8, left = frames * frame_bytes;
+   ssize_t err;
+
+   written += frames;
+   /* a WAV header can't describe more, keep the whole frames that fit */
+   if (file_wav && file_bytes + left > WAV_MAX_DATA) {
+      if (!file_full)
+         fprintf(stderr, "piano: the output file is full at the 4GiB a WAV file can hold, dropping the rest\n");
+      file_full = 1;
+      left = (WAV_MAX_DATA - file_bytes) / frame_bytes * frame_bytes;
+   }
+   while (file_fd >= 0 && left > 0) {
+      err = write(file_fd, p, left);
+      if (err < 0 && errno != EINTR) {
+         fprintf(stderr, "%s: write: %s\n", __func__, strerror(errno));
+         exit(1);
+      }
+      if (err > 0) {
+         p += err;
+         left -= err;
+         file_bytes += err;
+      }
+   }
+   return 0;
+}
+
+static void sink_start(void)
+{
+   if (clocked && !running) {
+      running = 1;
+      clock_start = now_ns();
+   }
+}
+
+static void sink_stop(void)
+{
+   running = 0;
+   written = 0;
+}
+
+static void sink_close(void)
+{
+   if (file_fd >= 0) {
+      if (file_wav)
+         wav_write_header(file_fd, channels, rate, format, file_bytes);
+      close(file_fd);
+      file_fd = -1;
+   }
+   if (areas)
+      free(areas[0].addr);
+   free(areas);
+}
+
+const struct backend null_backend = {
+   "null", null_open, sink_wait, sink_avail, sink_delay,
+   sink_begin, sink_commit, sink_start, sink_stop, sink_close,
+};
+
+const struct backend clock_backend = {
+   "clock", clock_open, sink_wait, sink_avail, sink_delay,
+   sink_begin, sink_commit, sink_start, sink_stop, sink_close,
+};
+
+const struct backend file_backend = {
+   "file", file_open, sink_wait, sink_avail, sink_delay,
+   sink_begin, sink_commit, sink_start, sink_stop, sink_close,
+};
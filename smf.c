@@ -0,0 +1,246 @@
+/*
+ *  smf.c  Standard MIDI File reader of Piano.
+ *
+ *  Copyright (C) 2008 Tigran Aivazian <tigran@bibles.org.uk>
+ *
+ *  Reads format 0 and 1 files into one list of note events sorted by
+ *  time in seconds, with the tempo map and running status applied.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "piano.h"
+
+struct smf_raw {
+   unsigned long tick;
+   unsigned int seq;     /* order of appearance, keeps the sort stable */
+   unsigned int tempo;   /* microseconds per quarter note, 0 for notes */
+   struct smf_event ev;
+};
+
+static struct smf_raw *raw;
+static int nraw, raw_size;
+
+static void add_raw(const struct smf_raw *r)
+{
+   if (nraw == raw_size) {
+      raw_size = raw_size ? raw_size * 2 : 1024;
+      raw = realloc(raw, raw_size * sizeof(*raw));
+      if (!raw) {
+         fprintf(stderr, "%s: Can't realloc memory for MIDI events\n", __func__);
+         exit(1);
+      }
+   }
+   raw[nraw] = *r;
+   raw[nraw].seq = nraw;
+   nraw++;
+}
+
+static unsigned long be32(const unsigned char *p)
+{
+   return ((unsigned long)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/* variable length quantity, returns -1 if it runs past end */
+static long read_vlq(const unsigned char **pp, const unsigned char *end)
+{
+   const unsigned char *p = *pp;
+   long val = 0;
+   int i;
+
+   for (i = 0; i < 4 && p < end; i++) {
+      val = (val << 7) | (*p & 0x7f);
+      if (!(*p++ & 0x80)) {
+         *pp = p;
+         return val;
+      }
+   }
+   return -1;
+}
+
+static int parse_track(const char *filename, const unsigned char *p, const unsigned char *end)
+{
+   unsigned long tick = 0;
+   unsigned char status = 0, type;
+   struct smf_raw r;
+   long delta, len;
+
+   while (p < end) {
+      if ((delta = read_vlq(&p, end)) < 0 || p >= end)
+         goto truncated;
+      tick += delta;
+
+      if (*p & 0x80)
+         status = *p++;
+      else if (!status) {
+         fprintf(stderr, "%s: \"%s\": data byte without status\n", __func__, filename);
+         return -1;
+      }
+
+      memset(&r, 0, sizeof(r));
+      r.tick = tick;
+      if (status == 0xff) { /* meta event */
+         if (p >= end)
+            goto truncated;
+         type = *p++;
+         if ((len = read_vlq(&p, end)) < 0 || len > end - p)
+            goto truncated;
+         if (type == 0x51 && len == 3) {
+            r.tempo = (p[0] << 16) | (p[1] << 8) | p[2];
+            add_raw(&r);
+         } else if (type == 0x2f)
+            return 0; /* end of track */
+         p += len;
+         status = 0; /* meta and sysex events cancel running status */
+      } else if (status == 0xf0 || status == 0xf7) { /* sysex */
+         if ((len = read_vlq(&p, end)) < 0 || len > end - p)
+            goto truncated;
+         p += len;
+         status = 0;
+      } else {
+         /* channel messages: program change and channel pressure take one data byte */
+         len = ((status & 0xf0) == 0xc0 || (status & 0xf0) == 0xd0) ? 1 : 2;
+         if (len > end - p)
+            goto truncated;
+         r.ev.channel = status & 0x0f;
+         switch (status & 0xf0) {
+            case 0x90:
+               r.ev.type = p[1] ? EV_NOTEON : EV_NOTEOFF;
+               break;
+            case 0x80:
+               r.ev.type = EV_NOTEOFF;
+               break;
+            case 0xb0:
+               if (p[0] == 64)
+                  r.ev.type = EV_SUSTAIN;
+               break;
+         }
+         if (r.ev.type) {
+            r.ev.note = p[0];
+            r.ev.velocity = p[1];
+            add_raw(&r);
+         }
+         p += len;
+      }
+   }
+   return 0;
+
+truncated:
+   fprintf(stderr, "%s: \"%s\": truncated track\n", __func__, filename);
+   return -1;
+}
+
+static int cmp_raw(const void *a, const void *b)
+{
+   const struct smf_raw *x = a, *y = b;
+
+   if (x->tick != y->tick)
+      return (x->tick < y->tick) ? -1 : 1;
+   return (x->seq < y->seq) ? -1 : (x->seq > y->seq);
+}
+
+/*
+ * Load filename and return its note events in time order, *count of them.
+ * The caller frees the array.  Exits on unreadable or malformed files.
+ */
+struct smf_event *smf_load(const char *filename, int *count)
+{
+   FILE *f;
+   long size;
+   unsigned char *buf, *p, *end;
+   unsigned int format, ntracks, division, track;
+   unsigned long len;
+   double seconds_per_tick, time = 0;
+   unsigned long last_tick = 0;
+   struct smf_event *events;
+   int i, n = 0, fps;
+
+   f = fopen(filename, "rb");
+   if (!f) {
+      fprintf(stderr, "%s: fopen(\"%s\"): %s\n", __func__, filename, strerror(errno));
+      exit(1);
+   }
+   fseek(f, 0, SEEK_END);
+   size = ftell(f);
+   rewind(f);
+   buf = malloc(size);
+   if (!buf || fread(buf, 1, size, f) != (size_t)size) {
+      fprintf(stderr, "%s: can't read \"%s\"\n", __func__, filename);
+      exit(1);
+   }
+   fclose(f);
+   end = buf + size;
+
+   if (size < 14 || memcmp(buf, "MThd", 4) || be32(buf + 4) < 6) {
+      fprintf(stderr, "%s: \"%s\" is not a Standard MIDI File\n", __func__, filename);
+      exit(1);
+   }
+   format = (buf[8] << 8) | buf[9];
+   ntracks = (buf[10] << 8) | buf[11];
+   division = (buf[12] << 8) | buf[13];
+   if (format > 1) {
+      fprintf(stderr, "%s: \"%s\": SMF format %u is not supported\n", __func__, filename, format);
+      exit(1);
+   }
+
+   if (division & 0x8000) { /* SMPTE: -frames per second, ticks per frame */
+      fps = -(signed char)(division >> 8);
+      if ((fps != 24 && fps != 25 && fps != 29 && fps != 30) || !(division & 0xff)) {
+         fprintf(stderr, "%s: \"%s\": invalid SMPTE division %d fps, %u ticks per frame\n",
+            __func__, filename, fps, division & 0xff);
+         exit(1);
+      }
+      /* 29 is drop frame, 30000/1001 frames a second */
+      seconds_per_tick = 1.0 / ((fps == 29 ? 30000.0 / 1001 : fps) * (division & 0xff));
+   } else if (division) /* ticks per quarter note, at the default 120 bpm until told otherwise */
+      seconds_per_tick = 0.5 / division;
+   else {
+      fprintf(stderr, "%s: \"%s\": division is 0 ticks per quarter note\n", __func__, filename);
+      exit(1);
+   }
+
+   nraw = 0;
+   p = buf + 8 + be32(buf + 4);
+   for (track = 0; track < ntracks && p + 8 <= end; track++) {
+      len = be32(p + 4);
+      if (len > (unsigned long)(end - p - 8)) {
+         fprintf(stderr, "%s: \"%s\": truncated file\n", __func__, filename);
+         exit(1);
+      }
+      if (!memcmp(p, "MTrk", 4) && parse_track(filename, p + 8, p + 8 + len) < 0)
+         exit(1);
+      p += 8 + len; /* unknown chunk types are skipped */
+   }
+   free(buf);
+
+   /* merge the tracks and walk the tempo map */
+   qsort(raw, nraw, sizeof(*raw), cmp_raw);
+   events = malloc((nraw ? nraw : 1) * sizeof(*events));
+   if (!events) {
+      fprintf(stderr, "%s: Can't malloc memory for MIDI events\n", __func__);
+      exit(1);
+   }
+   for (i = 0; i < nraw; i++) {
+      time += (raw[i].tick - last_tick) * seconds_per_tick;
+      last_tick = raw[i].tick;
+      if (raw[i].tempo) {
+         if (!(division & 0x8000))
+            seconds_per_tick = raw[i].tempo / 1e6 / division;
+         continue;
+      }
+      events[n] = raw[i].ev;
+      events[n].time = time;
+      n++;
+   }
+   free(raw);
+   raw = NULL;
+   raw_size = 0;
+
+   if (verbose)
+      fprintf(stderr, "%s: format %u, %u tracks, %d note events, %.1fs\n",
+         filename, format, ntracks, n, time);
+   *count = n;
+   return events;
+}
@@ -0,0 +1,224 @@
+/*
+ *  stream.c  disk streaming for the sample engine of Piano.
+ *
+ *  Copyright (C) 2008 Tigran Aivazian <tigran@bibles.org.uk>
+ *
+ *  In streaming mode only the first head_time milliseconds of every sample
+ *  are kept in memory.  When a voice starts, it plays from that head while
+ *  the I/O thread fills the voice's ring buffer with the rest of the sample
+ *  using pread(), so the audio thread never waits for the disk.
+ *
+ *  Each ring has one producer (the I/O thread) and one consumer (the audio
+ *  thread).  Positions are absolute frame numbers within the sample.  The
+ *  producer publishes 'filled' as (generation << 32 | frames), so a reader
+ *  never mistakes data left over from the voice's previous note for its own.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <semaphore.h>
+#include <pthread.h>
+#include "piano.h"
+
+#define RING_FRAMES  32768  /* per voice, must be a power of two */
+#define RING_MASK    (RING_FRAMES - 1)
+#define MIN_READ     4096   /* don't bother the disk for less than this */
+#define MAX_FRAME_BYTES 6   /* 24-bit stereo */
+
+struct stream {
+   /* written by the audio thread */
+   const struct sample_t *sample; /* NULL when the voice has stopped */
+   unsigned int gen;              /* bumped for every note, publishes sample */
+   unsigned int consumed;         /* frames the voice no longer needs */
+   /* written by the I/O thread */
+   unsigned long long filled;     /* gen << 32 | frames present in buf */
+   unsigned int io_gen;           /* generation the I/O thread is filling */
+   unsigned int io_pos;           /* next frame the I/O thread will read */
+   unsigned char *buf;            /* RING_FRAMES frames */
+};
+
+static int streaming = 0;           /* keep only sample heads in memory */
+static unsigned int head_time = 300; /* resident head of each sample in ms */
+static struct stream streams[POLYPHONY]; /* one per voice */
+static sem_t io_wakeup;
+static pthread_t io_thrid;
+static unsigned long underruns;
+
+void set_stream_mode(void)
+{
+   streaming = 1;
+}
+
+void set_head_time(unsigned int ms)
+{
+   if (ms < MINHEADTIME || ms > MAXHEADTIME) {
+      fprintf(stderr, "piano: invalid head time = %u, must be within [%u...%u]\n", ms, MINHEADTIME, MAXHEADTIME);
+      exit(1);
+   } else
+      head_time = ms;
+}
+
+/*
+ * Offline rendering runs faster than the disk can keep up with and has no
+ * deadline to protect, so it maps whole samples rather than drop frames.
+ * Packed samples are small enough to keep whole too.
+ */
+int stream_enabled(void)
+{
+   return streaming && !render_pending() && !pack_enabled();
+}
+
+/* number of frames of a sample that stay resident */
+unsigned int stream_head_frames(unsigned int sample_rate)
+{
+   return (unsigned long long)head_time * sample_rate / 1000;
+}
+
+unsigned long stream_underruns(void)
+{
+   return __atomic_load_n(&underruns, __ATOMIC_RELAXED);
+}
+
+/* I/O thread: top up one ring from disk */
+static void stream_fill(struct stream *st)
+{
+   unsigned int gen = __atomic_load_n(&st->gen, __ATOMIC_ACQUIRE);
+   const struct sample_t *s = __atomic_load_n(&st->sample, __ATOMIC_RELAXED);
+   unsigned int consumed, n, fb;
+   ssize_t err;
+
+   if (gen != st->io_gen) {
+      st->io_gen = gen;
+      st->io_pos = s ? s->head_size : 0;
+   }
+   if (!s)
+      return;
+   fb = s->channels * (s->sample_bits / 8);
+
+   while (st->io_pos < s->wave_size) {
+      consumed = __atomic_load_n(&st->consumed, __ATOMIC_ACQUIRE);
+      if (consumed > st->io_pos)
+         st->io_pos = consumed; /* the voice skipped ahead after an underrun */
+      n = RING_FRAMES - (st->io_pos - consumed);
+      if (n > s->wave_size - st->io_pos)
+         n = s->wave_size - st->io_pos;
+      if (n < MIN_READ && st->io_pos + n < s->wave_size)
+         break;
+      if (n > RING_FRAMES - (st->io_pos & RING_MASK))
+         n = RING_FRAMES - (st->io_pos & RING_MASK); /* up to the wrap */
+
+      err = pread(s->fd, st->buf + (st->io_pos & RING_MASK) * fb, (size_t)n * fb,
+                  s->data_offset + (off_t)st->io_pos * fb);
+      if (err <= 0) {
+         fprintf(stderr, "%s: pread: %s\n", __func__, err ? strerror(errno) : "unexpected end of file");
+         return;
+      }
+      st->io_pos += err / fb;
+      __atomic_store_n(&st->filled, (unsigned long long)gen << 32 | st->io_pos, __ATOMIC_RELEASE);
+      if (__atomic_load_n(&st->gen, __ATOMIC_ACQUIRE) != gen)
+         return; /* the voice moved on to another note */
+   }
+}
+
+static void *io_thread(void *arg ATTRIBUTE_UNUSED)
+{
+   int i;
+
+   while (!stop_pending()) {
+      while (sem_wait(&io_wakeup) == -1 && errno == EINTR)
+         ;
+      for (i = 0; i < POLYPHONY; i++)
+         stream_fill(&streams[i]);
+   }
+   return 0;
+}
+
+/* audio thread: begin streaming v->sample past its resident head */
+void stream_start(struct voice *v)
+{
+   struct stream *st = &streams[v->id];
+
+   st->consumed = v->sample->head_size;
+   __atomic_store_n(&st->sample, v->sample, __ATOMIC_RELAXED);
+   __atomic_store_n(&st->gen, st->gen + 1, __ATOMIC_RELEASE);
+   sem_post(&io_wakeup);
+}
+
+/* audio thread: the voice no longer needs its ring */
+void stream_stop(struct voice *v)
+{
+   struct stream *st = &streams[v->id];
+
+   __atomic_store_n(&st->sample, NULL, __ATOMIC_RELAXED);
+   __atomic_store_n(&st->gen, st->gen + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Audio thread: return the ring frames starting at frame pos, trimming
+ * *count to what is contiguous and already on hand.  Returns NULL and
+ * counts an underrun if the I/O thread has not caught up yet.
+ */
+const unsigned char *stream_frames(struct voice *v, unsigned int pos, int *count)
+{
+   struct stream *st = &streams[v->id];
+   unsigned long long f = __atomic_load_n(&st->filled, __ATOMIC_ACQUIRE);
+   unsigned int avail;
+
+   if ((unsigned int)(f >> 32) != st->gen || (unsigned int)f <= pos) {
+      __atomic_fetch_add(&underruns, 1, __ATOMIC_RELAXED);
+      return NULL;
+   }
+   avail = (unsigned int)f - pos;
+   if (*count > avail)
+      *count = avail;
+   if (*count > RING_FRAMES - (pos & RING_MASK))
+      *count = RING_FRAMES - (pos & RING_MASK);
+   return st->buf + (pos & RING_MASK) * v->sample->channels * (v->sample->sample_bits / 8);
+}
+
+/* audio thread: frames before pos may be overwritten, wake the I/O thread if low */
+void stream_consumed(struct voice *v, unsigned int pos)
+{
+   struct stream *st = &streams[v->id];
+   unsigned int filled = (unsigned int)__atomic_load_n(&st->filled, __ATOMIC_RELAXED);
+
+   __atomic_store_n(&st->consumed, pos, __ATOMIC_RELEASE);
+   if (filled < pos + RING_FRAMES / 2 && filled < v->sample->wave_size)
+      sem_post(&io_wakeup);
+}
+
+void streams_init(void)
+{
+   int i, err;
+
+   if (!stream_enabled())
+      return;
+
+   for (i = 0; i < POLYPHONY; i++) {
+      streams[i].buf = malloc(RING_FRAMES * MAX_FRAME_BYTES);
+      if (!streams[i].buf) {
+         fprintf(stderr, "%s: Can't malloc memory for stream buffers\n", __func__);
+         exit(1);
+      }
+      audio_lock(streams[i].buf, RING_FRAMES * MAX_FRAME_BYTES);
+   }
+   audio_lock(streams, sizeof(streams));
+
+   sem_init(&io_wakeup, 0, 0);
+   err = pthread_create(&io_thrid, NULL, io_thread, NULL);
+   if (err) {
+      fprintf(stderr, "%s: Error creating I/O thread: %s\n", __func__, strerror(err));
+      exit(1);
+   }
+   if (verbose)
+      fprintf(stderr, "Streaming samples, %ums resident heads\n", head_time);
+}
+
+void streams_cleanup(void)
+{
+   if (stream_enabled() && verbose)
+      fprintf(stderr, "Stream underruns: %lu\n", stream_underruns());
+}
@@ -0,0 +1,434 @@
+/*
+ *  voice.c  polyphonic voice pool of Piano.
+ *
+ *  Copyright (C) 2008 Tigran Aivazian <tigran@bibles.org.uk>
+ *
+ *  Every voice has a place between the first and the last output channel,
+ *  spread across them by key like on a real piano's soundboard.  Its gains
+ *  only change when that place does, and then they glide to their new
+ *  values over one block instead of being worked out for every frame.
+ *
+ *  The ADSR envelope is worked out the same way: once per block for the
+ *  block's last frame, and ramped to it along with the gains.  A voice
+ *  whose envelope has faded below ENV_FLOOR is freed after that block,
+ *  so notes cost nothing once they can't be heard, however long the key
+ *  is held.  Releasing a key while the sustain pedal is down leaves its
+ *  voices sounding until the pedal comes up.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "piano.h"
+
+#define VOICE_GAIN 0.25 /* per-voice gain, leaves headroom for chords */
+#define PAN_BLOCK  256  /* frames of a voice rendered before they are panned */
+#define ENV_FLOOR  3e-5 /* about -90dB, the envelope is inaudible below it */
+
+enum { ENV_ATTACK, ENV_DECAY, ENV_RELEASE };
+
+static struct voice voices[POLYPHONY];
+static struct voice *free_voices[POLYPHONY]; /* stack of unused voices */
+static int nfree;
+static struct voice *active[POLYPHONY]; /* only these are mixed */
+static int nactive;
+static unsigned long voice_clock; /* incremented on every allocation */
+static unsigned int channels;
+static unsigned int spread = 50; /* percent of the channels the keyboard spans */
+static unsigned int spread_applied = 50; /* what the active voices are panned for */
+static const struct tuning *tuning_applied; /* what the active voices are tuned to */
+static int pedal;                 /* the sustain pedal is down */
+
+/* envelope times in milliseconds, decay and release to -60dB, sustain in percent */
+static unsigned int attack_ms = 2, decay_ms = 10000, sustain_pc = 0, release_ms = 250;
+static double attack_step;        /* envelope rise per frame */
+static double decay_log;          /* log of the decay and release multipliers per frame */
+static double release_log;
+
+static const double max_phase = 2.0 * M_PI;
+
+/* pure sine, one transcendental per frame */
+static void sine_retune(struct voice *v, const struct tuning *t)
+{
+   v->phase_step = max_phase * t->step[v->note];
+}
+
+static void sine_start(struct voice *v, const struct tuning *t)
+{
+   v->phase = 0;
+   sine_retune(v, t);
+}
+
+static int sine_render(struct voice *v, float *out, int count)
+{
+   kernels.sine(out, count, &v->phase, v->phase_step, v->amplitude);
+   return 1;
+}
+
+static const struct engine engines[] = {
+   { "wavetable", wavetable_start, wavetable_render, NULL, NULL, wavetable_retune },
+   { "sine", sine_start, sine_render, NULL, NULL, sine_retune },
+   { "sample", sampler_start, sampler_render, sampler_stop, NULL, sampler_retune },
+   /* a string keeps the pitch it was struck at, only new notes follow the tuning */
+   { "waveguide", waveguide_start, NULL, NULL, waveguide_render_group, NULL },
+   { "additive", additive_start, additive_render, NULL, NULL, NULL },
+};
+static const struct engine *engine = &engines[0];
+
+void set_engine(char *name)
+{
+   unsigned int i;
+
+   for (i = 0; i < sizeof(engines)/sizeof(engines[0]); i++) {
+      if (!strcmp(name, engines[i].name)) {
+         engine = &engines[i];
+         return;
+      }
+   }
+   fprintf(stderr, "piano: unknown synthesis engine \"%s\", must be one of:", name);
+   for (i = 0; i < sizeof(engines)/sizeof(engines[0]); i++)
+      fprintf(stderr, " %s", engines[i].name);
+   fprintf(stderr, "\n");
+   exit(1);
+}
+
+void set_envelope(char *spec)
+{
+   unsigned int a, d, s, r;
+
+   if (sscanf(spec, "%u:%u:%u:%u", &a, &d, &s, &r) != 4) {
+      fprintf(stderr, "piano: invalid envelope = %s, must be attack:decay:sustain:release\n", spec);
+      exit(1);
+   }
+   if (a > MAXENVTIME || d > MAXENVTIME || r > MAXENVTIME) {
+      fprintf(stderr, "piano: invalid envelope time in %s, must be within [%u...%u]\n", spec, MINENVTIME, MAXENVTIME);
+      exit(1);
+   }
+   if (s > 100) {
+      fprintf(stderr, "piano: invalid sustain level = %u, must be within [0...100]\n", s);
+      exit(1);
+   }
+   attack_ms = a;
+   decay_ms = d;
+   sustain_pc = s;
+   release_ms = r;
+}
+
+/* log of the per frame multiplier that falls 60dB in ms milliseconds */
+static double fall_log(unsigned int ms)
+{
+   return ms ? -3 * M_LN10 * 1000 / ((double)ms * get_rate()) : -INFINITY;
+}
+
+void set_spread(int percent)
+{
+   if (percent < MINSPREAD || percent > MAXSPREAD) {
+      fprintf(stderr, "piano: invalid spread = %d, must be within [%d...%d]\n", percent, MINSPREAD, MAXSPREAD);
+      exit(1);
+   } else
+      __atomic_store_n(&spread, percent, __ATOMIC_RELAXED); /* the shell changes it while playing */
+}
+
+/* place v by its key and work out its gains there, panning between two
+   neighbouring channels with equal power */
+static void voice_pan(struct voice *v)
+{
+   double key = (double)(v->note - MINMIDINOTE) / (NKEYS - 1); /* 0 bass, 1 treble */
+   double x, f;
+   unsigned int c;
+
+   v->pan = 0.5 + __atomic_load_n(&spread, __ATOMIC_RELAXED) / 100.0 * (key - 0.5);
+   memset(v->target, 0, sizeof(v->target));
+   if (channels == 1) {
+      v->target[0] = 1;
+      return;
+   }
+   x = v->pan * (channels - 1);
+   c = x;
+   if (c > channels - 2)
+      c = channels - 2;
+   f = x - c;
+   v->target[c] = cos(f * M_PI / 2);
+   v->target[c + 1] = sin(f * M_PI / 2);
+}
+
+/*
+ * Gains of v for frames start to end of a count frame block, as they glide
+ * from gain[] to target[] and the envelope from env to env_end over the
+ * block, times scale.  Channel c's are stored at from[c * stride] and
+ * to[c * stride].
+ */
+void voice_gains(const struct voice *v, float *from, float *to, int stride,
+                 int start, int end, int count, float scale)
+{
+   float e0 = scale * (v->env + (v->env_end - v->env) * start / count);
+   float e1 = scale * (v->env + (v->env_end - v->env) * end / count);
+   unsigned int c;
+   float d;
+
+   for (c = 0; c < channels; c++) {
+      d = v->target[c] - v->gain[c];
+      from[c * stride] = e0 * (v->gain[c] + d * start / count);
+      to[c * stride] = e1 * (v->gain[c] + d * end / count);
+   }
+}
+
+/* the glide is over once a block has been rendered */
+static void voice_settle(struct voice *v)
+{
+   memcpy(v->gain, v->target, sizeof(v->gain));
+   v->env = v->env_end;
+}
+
+/* where v's envelope will be after count more frames, 0 once it has faded away */
+static int voice_envelope(struct voice *v, int count)
+{
+   double e = v->env, s = sustain_pc / 100.0;
+
+   switch (v->stage) {
+      case ENV_ATTACK:
+         e += count * attack_step;
+         if (e >= 1) {
+            e = 1;
+            v->stage = ENV_DECAY;
+         }
+         break;
+      case ENV_DECAY:
+         e = s + (e - s) * exp(count * decay_log);
+         break;
+      case ENV_RELEASE:
+         e *= exp(count * release_log);
+         break;
+   }
+   v->env_end = e;
+   return v->stage == ENV_ATTACK || e >= ENV_FLOOR;
+}
+
+static void voice_release(struct voice *v)
+{
+   v->stage = ENV_RELEASE;
+   v->sustained = 0;
+}
+
+void voices_init(void)
+{
+   int i;
+
+   memset(voices, 0, sizeof(voices));
+   for (i = 0; i < POLYPHONY; i++) {
+      voices[i].id = i;
+      free_voices[i] = &voices[POLYPHONY - 1 - i];
+   }
+   nfree = POLYPHONY;
+   nactive = 0;
+   audio_lock(voices, sizeof(voices));
+   audio_lock(free_voices, sizeof(free_voices));
+   audio_lock(active, sizeof(active));
+   channels = get_channels();
+   pedal = 0;
+
+   /* an instant attack still ramps up over the first block */
+   attack_step = attack_ms ? 1000.0 / ((double)attack_ms * get_rate()) : 1;
+   decay_log = fall_log(decay_ms);
+   release_log = fall_log(release_ms);
+}
+
+/* return active[i] to the free stack, keeping active[] dense */
+static void voice_free(int i)
+{
+   struct voice *v = active[i];
+
+   if (engine->stop)
+      engine->stop(v);
+   active[i] = active[--nactive];
+   free_voices[nfree++] = v;
+}
+
+/* pick the quietest voice, the oldest one among equally quiet voices */
+static int voice_steal(void)
+{
+   float a, quietest = active[0]->amplitude * active[0]->env;
+   int i, victim = 0;
+
+   for (i = 1; i < nactive; i++) {
+      a = active[i]->amplitude * active[i]->env;
+      if (a < quietest || (a == quietest && active[i]->age < active[victim]->age)) {
+         quietest = a;
+         victim = i;
+      }
+   }
+   return victim;
+}
+
+/* velocity 1...127, the gain follows its square: -12dB at half velocity */
+void voice_on(int note, int velocity)
+{
+   struct voice *v;
+
+   if (note < MINMIDINOTE || note > MAXMIDINOTE)
+      return;
+
+   if (!nfree)
+      voice_free(voice_steal());
+
+   v = free_voices[--nfree];
+   v->note = note;
+   v->velocity = velocity;
+   v->amplitude = VOICE_GAIN * (velocity / 127.0) * (velocity / 127.0);
+   v->stage = ENV_ATTACK;
+   v->sustained = 0;
+   v->env = v->env_end = 0;
+   engine->start(v, get_tuning());
+   voice_pan(v);
+   voice_settle(v); /* a new note starts where it belongs */
+   v->age = voice_clock++;
+   active[nactive++] = v;
+}
+
+void voice_off(int note)
+{
+   int i;
+
+   for (i = 0; i < nactive; i++) {
+      if (active[i]->note != note || active[i]->stage == ENV_RELEASE || active[i]->sustained)
+         continue;
+      if (pedal)
+         active[i]->sustained = 1; /* until the pedal comes up */
+      else
+         voice_release(active[i]);
+   }
+}
+
+/* the sustain pedal, CC64: up below 64 */
+void voice_sustain(int value)
+{
+   int i;
+
+   pedal = value >= 64;
+   if (pedal)
+      return;
+   for (i = 0; i < nactive; i++)
+      if (active[i]->sustained)
+         voice_release(active[i]);
+}
+
+int voices_active(void)
+{
+   return nactive;
+}
+
+/*
+ * The offline renderer splits active voices into chunks that threads
+ * render independently: single voices, or VOICE_CHUNK for an engine that
+ * renders them in groups.  Chunk membership only depends on the order of
+ * active[], never on the number of threads.
+ */
+static int chunk_voices(void)
+{
+   return engine->render_group ? VOICE_CHUNK : 1;
+}
+
+int voices_chunks(void)
+{
+   int size = chunk_voices();
+
+   return (nactive + size - 1) / size;
+}
+
+static void bus_clear(float *bus, int stride, int count)
+{
+   unsigned int c;
+
+   for (c = 0; c < channels; c++)
+      memset(bus + c * stride, 0, count * sizeof(float));
+}
+
+/* add count frames of v to the channels of bus, returns 0 once v has finished */
+static int voice_render(struct voice *v, float *bus, int stride, int count)
+{
+   float out[PAN_BLOCK] __attribute__((aligned(32))), from[MAXCHANNELS], to[MAXCHANNELS];
+   int done, n, alive = 1;
+
+   for (done = 0; alive && done < count; done += n) {
+      n = (count - done < PAN_BLOCK) ? count - done : PAN_BLOCK;
+      memset(out, 0, n * sizeof(float));
+      alive = engine->render(v, out, n);
+      voice_gains(v, from, to, 1, done, done + n, count, 1);
+      kernels.pan(bus + done, stride, channels, out, n, from, to);
+   }
+   voice_settle(v);
+   return alive;
+}
+
+/* render n voices starting at active[first] into bus, marking the finished ones */
+static void voices_render_range(int first, int n, float *bus, int stride, int count)
+{
+   int i;
+
+   /* a voice that fades out during this block is rendered down to silence and retired */
+   for (i = first; i < first + n; i++)
+      active[i]->finished = !voice_envelope(active[i], count);
+
+   if (engine->render_group) {
+      engine->render_group(active + first, n, bus, stride, count);
+      for (i = first; i < first + n; i++)
+         voice_settle(active[i]);
+      return;
+   }
+   for (i = first; i < first + n; i++)
+      if (!voice_render(active[i], bus, stride, count))
+         active[i]->finished = 1;
+}
+
+/*
+ * Render chunk c alone into bus, channel planes stride floats apart;
+ * finished voices are freed by voices_reap().
+ */
+void voices_render_chunk(int c, float *bus, int stride, int count)
+{
+   int size = chunk_voices(), end = (c + 1) * size;
+
+   bus_clear(bus, stride, count);
+   if (end > nactive)
+      end = nactive;
+   voices_render_range(c * size, end - c * size, bus, stride, count);
+}
+
+/* free the voices voices_render_chunk() found finished */
+void voices_reap(void)
+{
+   int i = 0;
+
+   while (i < nactive) {
+      if (active[i]->finished) {
+         active[i]->finished = 0;
+         voice_free(i);
+      } else
+         i++;
+   }
+}
+
+/* mix count frames of all active voices into the channel planes of bus */
+void voices_render(float *bus, int stride, int count)
+{
+   unsigned int s = __atomic_load_n(&spread, __ATOMIC_RELAXED);
+   const struct tuning *t = get_tuning();
+   int i;
+
+   /* the voices glide to their new places during this block */
+   if (s != spread_applied) {
+      spread_applied = s;
+      for (i = 0; i < nactive; i++)
+         voice_pan(active[i]);
+   }
+   /* and change pitch at its start, keeping their phase */
+   if (t != tuning_applied) {
+      tuning_applied = t;
+      for (i = 0; engine->retune && i < nactive; i++)
+         engine->retune(active[i], t);
+   }
+   bus_clear(bus, stride, count);
+   voices_render_range(0, nactive, bus, stride, count);
+   voices_reap();
+}
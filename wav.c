@@ -4,10 +4,18 @@
  *  Copyright (C) 2008 Tigran Aivazian <tigran@bibles.org.uk>
  */
 
-
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include "piano.h"
 
 #pragma pack (1)
 struct wav_file_head_t
@@ -16,7 +24,7 @@ struct wav_file_head_t
    unsigned int	length; /* Length of subsequent file (including remainder of header).
                This is in Intel reverse byte order if RIFF, Motorola format if FORM. */
    unsigned char type[4]; /* {'W', 'A', 'V', 'E'} or {'A', 'I', 'F', 'F'} */
-} wav_file_head;
+};
 
 struct wav_chunk_head_t
 {
@@ -24,7 +32,7 @@ struct wav_chunk_head_t
    unsigned int length;	/* Length of subsequent data within this chunk.
          This is in Intel reverse byte order if RIFF, Motorola format if FORM.
     NOTE: this doesn't include any extra byte needed to pad the chunk out to an even size. */
-} wav_chunk_head;
+};
 
 struct wav_format_t {
    short tag;
@@ -34,99 +42,529 @@ struct wav_format_t {
    unsigned short block_align;
    unsigned short sample_bits;
    /* Note: there may be additional fields here, depending upon 'tag' */
-} wav_format;
+};
+
+/* what follows wav_format_t when tag is WAV_EXTENSIBLE */
+struct wav_extension_t {
+   unsigned short size;           /* of the rest, 22 */
+   unsigned short valid_bits;
+   unsigned int channel_mask;
+   unsigned char sub_format[16];  /* GUID whose first two bytes are the real tag */
+};
 #pragma pack()
 
-static struct sample_t {
-   unsigned char *wave_data;
-   unsigned int wave_size;
-} sample[NKEYS]; /* one buffer per key */
+#define WAV_PCM        1
+#define WAV_EXTENSIBLE 0xfffe
+
+/* KSDATAFORMAT_SUBTYPE_PCM */
+static const unsigned char wav_pcm_guid[16] = {
+   0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71
+};
+
+#define WAV_PREFAULT (64*1024) /* bytes of each sample to fault in at load time */
+#define ARENA_ALIGN (2*1024*1024) /* a huge page */
+#define ARENA_SLOT  64            /* every sample starts on a cache line */
 
-/* fills in sample[key] structure */
-static void load_sample(int key)
+/* the round-robin alternatives a key has for a range of velocities */
+struct layer {
+   int velocity;            /* the loudest note it plays */
+   unsigned int first;      /* its first sample in samples[] */
+   unsigned int slots;      /* number of alternatives */
+   unsigned int next;       /* the one the next note plays */
+};
+
+/* a file of the sample directory */
+struct sample_file {
+   int note, velocity, slot;
+   char name[256];
+};
+
+static char *sample_dir; /* directory holding <MIDI note>[_<velocity>[_<slot>]].wav files */
+static struct sample_t *samples; /* every sample, by key, layer and slot */
+static unsigned int nsamples;
+static struct layer *layers;     /* every key's layers, softest first */
+static unsigned int nlayers;
+static unsigned short key_layer[NKEYS][128]; /* layer every key plays at every velocity */
+static unsigned char *arena;     /* the frames of all samples, unless mapped */
+static size_t arena_size;
+static int map_mode;             /* play plain samples from their mappings */
+
+void set_sample_dir(char *dir)
 {
-   int fd;
-   unsigned char *ptr = NULL;
-   char *filename = "sin440.wav";
+   sample_dir = strdup(dir);
+}
 
-   fd = open(filename, O_RDONLY); /* will depend on 'key' eventually */
-   if (fd == -1) {
-      fprintf(stderr, "%s: open(), %s\n", __func__, strerror(errno));
-      exit(1);
+void set_map_mode(void)
+{
+   map_mode = 1;
+}
+
+/* the sample for a note at a velocity, taking the layer's alternatives in turn */
+const struct sample_t *get_sample(int note, int velocity)
+{
+   struct layer *l;
+   const struct sample_t *s;
+
+   if (!layers || note < MINMIDINOTE || note > MAXMIDINOTE)
+      return NULL;
+   l = &layers[key_layer[note - MINMIDINOTE][velocity & 127]];
+   s = &samples[l->first + l->next];
+   if (++l->next == l->slots)
+      l->next = 0;
+   return s;
+}
+
+/*
+ * Let every key without a sample of its own borrow the nearest recorded one,
+ * so a library with a sample every few semitones covers the whole keyboard.
+ * has[] tells the keys that have their own.
+ */
+static void map_keys(const int *has)
+{
+   int key, d, k, src;
+
+   for (key = 0; key < NKEYS; key++) {
+      for (src = -1, d = 0; d < NKEYS && src < 0; d++) {
+         k = key + d;
+         if (k < NKEYS && has[k])
+            src = k;
+         k = key - d;
+         if (k >= 0 && has[k])
+            src = k;
+      }
+      if (src != key)
+         memcpy(key_layer[key], key_layer[src], sizeof(key_layer[key]));
    }
+}
 
-   if (read(fd, &wav_file_head, sizeof(wav_file_head)) != sizeof(wav_file_head)) {
-      fprintf(stderr, "%s: read(wav_file_head): %s\n", __func__, strerror(errno));
-      exit(1);
+/*
+ * One mapping for the frames of every sample, on huge pages if the system
+ * has some set aside and else on transparent ones, so 128 voices reading
+ * all over the library don't each need TLB entries of their own.
+ */
+static unsigned char *arena_alloc(size_t size, const char **kind)
+{
+   unsigned char *p;
+   size_t lead;
+
+   arena_size = (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+   if (!arena_size)
+      arena_size = ARENA_ALIGN;
+   p = mmap(NULL, arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+   if (p != MAP_FAILED) {
+      *kind = "huge pages";
+      return p;
    }
 
-   if (memcmp("RIFF", wav_file_head.id, 4) && memcmp("WAVE", wav_file_head.id, 4)) {
-      fprintf(stderr, "%s: \"%s\" is not a WAV file\n", __func__, filename);
+   /* align it by hand, so the kernel can back it with whole huge pages */
+   p = mmap(NULL, arena_size + ARENA_ALIGN, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (p == MAP_FAILED) {
+      fprintf(stderr, "%s: mmap(%zu): %s\n", __func__, arena_size, strerror(errno));
       exit(1);
    }
+   lead = (ARENA_ALIGN - (unsigned long)p % ARENA_ALIGN) % ARENA_ALIGN;
+   if (lead)
+      munmap(p, lead);
+   munmap(p + lead + arena_size, ARENA_ALIGN - lead);
+   p += lead;
+   madvise(p, arena_size, MADV_HUGEPAGE);
+   *kind = "transparent huge pages";
+   return p;
+}
 
-   while (read(fd, &wav_chunk_head, sizeof(wav_chunk_head)) == sizeof(wav_chunk_head)) {
-      if (!memcmp("fmt ", wav_chunk_head.id, 4)) {
-         if (read(fd, &wav_format, sizeof(wav_format)) != sizeof(wav_format)) {
-            fprintf(stderr, "%s: read(wav_format): %s\n", __func__, strerror(errno));
-            exit(1);
-         } 
+/*
+ * Copy what stays resident of s into the arena at to and drop its mapping,
+ * returning the arena bytes it took.  A streamed sample keeps its first
+ * few hundred milliseconds and its file open so stream.c can pread() the
+ * rest on demand.  With --map any other sample stays in its mapping,
+ * paged in as it is played and shared with the page cache.
+ */
+static size_t keep_frames(struct sample_t *s, unsigned char *to)
+{
+   size_t size;
+
+   if (s->packed)
+      size = pack_move(s, to);
+   else if (s->fd < 0 && map_mode)
+      return 0;
+   else {
+      size = (size_t)s->head_size * s->channels * (s->sample_bits / 8);
+      memcpy(to, s->wave_data, size);
+      s->wave_data = to;
+      munmap(s->map, s->map_size);
+      s->map = NULL;
+   }
+
+   if (s->fd >= 0 && s->head_size == s->wave_size) {
+      close(s->fd); /* nothing left to stream */
+      s->fd = -1;
+   } else if (s->fd >= 0)
+      posix_fadvise(s->fd, s->data_offset, 0, POSIX_FADV_SEQUENTIAL);
+   return (size + ARENA_SLOT - 1) / ARENA_SLOT * ARENA_SLOT;
+}
 
-         if (wav_format.tag != 1) {
-            fprintf(stderr, "%s: can't handle compressed WAV files\n", __func__);
-            exit(1);
-         }
 /*
-         *sample_bits = wav_format.sample_bits;
-         *sample_rate = (unsigned short)wav_format.sample_rate;
-         *channels = wav_format.channels;
-*/
-      } else if (!memcmp("data", wav_chunk_head.id, 4)) {
-         ptr = (unsigned char *)malloc(wav_chunk_head.length);
-         if (!ptr) {
-            fprintf(stderr, "%s: malloc(%d) failed\n", __func__, wav_chunk_head.length);
-            exit(1);
+ * How much of s the arena will hold.  Packing reads the whole file and
+ * leaves the packed sample in memory of its own until keep_frames().
+ */
+static size_t resident_size(struct sample_t *s)
+{
+   size_t size;
+
+   if (pack_enabled()) {
+      size = pack_sample(s);
+      munmap(s->map, s->map_size);
+      s->map = NULL;
+      s->wave_data = NULL;
+      s->head_size = 0; /* every frame comes from pack_frames() */
+   } else if (s->fd < 0 && map_mode)
+      size = 0; /* played from its mapping */
+   else {
+      if (s->fd >= 0 && s->head_size > stream_head_frames(s->sample_rate))
+         s->head_size = stream_head_frames(s->sample_rate);
+      size = (size_t)s->head_size * s->channels * (s->sample_bits / 8);
+   }
+   return (size + ARENA_SLOT - 1) / ARENA_SLOT * ARENA_SLOT;
+}
+
+/*
+ * Map filename and point s->wave_data at its PCM data.  Nothing is copied:
+ * pages are only read from disk when they are used.  With stream set the
+ * file is kept open in s->fd.  Returns 0 on success, -1 if the file is
+ * missing or not a usable WAV file.
+ */
+static int map_sample(const char *filename, struct sample_t *s, int stream)
+{
+   int fd;
+   struct stat st;
+   unsigned char *map, *p, *end;
+   struct wav_file_head_t head;
+   struct wav_chunk_head_t chunk;
+   struct wav_format_t format;
+   struct wav_extension_t ext;
+   int have_format = 0;
+
+   fd = open(filename, O_RDONLY);
+   if (fd == -1)
+      return -1;
+
+   if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(head)) {
+      fprintf(stderr, "%s: \"%s\" is too short for a WAV file\n", __func__, filename);
+      close(fd);
+      return -1;
+   }
+
+   map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   if (map == MAP_FAILED) {
+      fprintf(stderr, "%s: mmap(\"%s\"): %s\n", __func__, filename, strerror(errno));
+      close(fd);
+      return -1;
+   }
+   end = map + st.st_size;
+
+   memcpy(&head, map, sizeof(head));
+   if (memcmp("RIFF", head.id, 4) || memcmp("WAVE", head.type, 4)) {
+      fprintf(stderr, "%s: \"%s\" is not a WAV file\n", __func__, filename);
+      goto bad;
+   }
+
+   p = map + sizeof(head);
+   while (p + sizeof(chunk) <= end) {
+      memcpy(&chunk, p, sizeof(chunk));
+      p += sizeof(chunk);
+      if (chunk.length > (size_t)(end - p)) {
+         fprintf(stderr, "%s: \"%s\" is truncated\n", __func__, filename);
+         goto bad;
+      }
+      if (!memcmp("fmt ", chunk.id, 4)) {
+         if (chunk.length < sizeof(format)) {
+            fprintf(stderr, "%s: \"%s\" has a short fmt chunk\n", __func__, filename);
+            goto bad;
+         }
+         memcpy(&format, p, sizeof(format));
+         if ((unsigned short)format.tag == WAV_EXTENSIBLE) {
+            if (chunk.length < sizeof(format) + sizeof(ext)) {
+               fprintf(stderr, "%s: \"%s\" has a short extensible fmt chunk\n", __func__, filename);
+               goto bad;
+            }
+            memcpy(&ext, p + sizeof(format), sizeof(ext));
+            if (!memcmp(ext.sub_format, wav_pcm_guid, sizeof(wav_pcm_guid)))
+               format.tag = WAV_PCM;
+         }
+         if (format.tag != WAV_PCM) {
+            fprintf(stderr, "%s: \"%s\": can't handle WAV files that aren't PCM\n", __func__, filename);
+            goto bad;
          }
+         if ((format.sample_bits != 16 && format.sample_bits != 24) ||
+             format.channels < 1 || format.channels > 2 ||
+             format.block_align != format.channels * format.sample_bits / 8) {
+            fprintf(stderr, "%s: \"%s\": only 16 or 24-bit mono or stereo PCM is supported\n",
+               __func__, filename);
+            goto bad;
+         }
+         if (!format.sample_rate) {
+            fprintf(stderr, "%s: \"%s\" has a sample rate of 0\n", __func__, filename);
+            goto bad;
+         }
+         have_format = 1;
+      } else if (!memcmp("data", chunk.id, 4)) {
+         if (!have_format) {
+            fprintf(stderr, "%s: \"%s\": data chunk before fmt chunk\n", __func__, filename);
+            goto bad;
+         }
+         if (chunk.length < format.block_align) {
+            fprintf(stderr, "%s: \"%s\" has no frames\n", __func__, filename);
+            goto bad;
+         }
+         s->wave_data = p;
+         s->wave_size = chunk.length / format.block_align;
+         s->head_size = s->wave_size;
+         s->channels = format.channels;
+         s->sample_bits = format.sample_bits;
+         s->sample_rate = format.sample_rate;
+         s->fd = -1;
+         s->map = map;
+         s->map_size = st.st_size;
+         s->data_offset = p - map;
 
-         if (read(fd, ptr, wav_chunk_head.length) != wav_chunk_head.length) {
-            fprintf(stderr, "%s: read() %d bytes of data): %s\n", __func__, wav_chunk_head.length, strerror(errno));
-            exit(1);
-         } 
+         if (stream)
+            s->fd = fd;
+         else
+            close(fd); /* the mapping keeps the file referenced */
 
-         sample[key].wave_size = (wav_chunk_head.length * 8) / ((unsigned int)wav_format.sample_bits * (unsigned int)wav_format.channels);
-         sample[key].wave_data = ptr;
-         break;
-      } else {
-         if (wav_chunk_head.length & 1) ++wav_chunk_head.length;  // If odd, round it up to account for pad byte
-         lseek(fd, wav_chunk_head.length, SEEK_CUR);
+         /* voices read forwards, and every onset reads the head first */
+         madvise(map, st.st_size, MADV_SEQUENTIAL);
+         madvise(map, (st.st_size < WAV_PREFAULT) ? st.st_size : WAV_PREFAULT, MADV_WILLNEED);
+         return 0;
       }
+      p += chunk.length + (chunk.length & 1); /* chunks are padded to even size */
    }
+   fprintf(stderr, "%s: \"%s\" has no data chunk\n", __func__, filename);
 
-   return;
+bad:
+   munmap(map, st.st_size);
+   close(fd);
+   return -1;
 }
 
-static void play_samples(void)
-{
-   snd_pcm_sframes_t count = 0, frames;
-   unsigned char *wave_data = sample[0].wave_data;
-   snd_pcm_uframes_t wave_size = sample[0].wave_size;
-   
-   do {
-      snd_pcm_prepare(pcm);
-      frames = snd_pcm_writei(pcm, wave_data + count, wave_size - count);
-      fprintf(stderr, "%s: written %ld frames\n", __func__, frames);
-
-      if (frames < 0) {
-         frames = snd_pcm_recover(pcm, frames, 0);
-         fprintf(stderr, "%s: Recovered from error, frames=%ld\n",
-            __func__, frames);
-      }
-      if (frames < 0) {
-         fprintf(stderr, "%s: Error (frames=%ld): %s\n",
-            __func__, frames, snd_strerror(frames));
+/* map the whole of filename, for whoever wants a WAV file that isn't a key's sample */
+int wav_map(const char *filename, struct sample_t *s)
+{
+   return map_sample(filename, s, 0);
+}
+
+/* <MIDI note>[_<velocity>[_<slot>]].wav, 0 if name is one */
+static int parse_name(const char *name, struct sample_file *f)
+{
+   const char *p = name;
+   char *end;
+   long v[3];
+   int n = 0;
+
+   while (n < 3) {
+      if (*p < '0' || *p > '9')
+         return -1;
+      v[n++] = strtol(p, &end, 10);
+      p = end;
+      if (*p != '_')
          break;
+      p++;
+   }
+   if (strcmp(p, ".wav") || strlen(name) >= sizeof(f->name))
+      return -1;
+   f->note = v[0];
+   f->velocity = (n > 1) ? v[1] : 127;
+   f->slot = (n > 2) ? v[2] : 0;
+   if (f->note < MINMIDINOTE || f->note > MAXMIDINOTE || f->velocity < 1 || f->velocity > 127)
+      return -1;
+   strcpy(f->name, name);
+   return 0;
+}
+
+static int compare_files(const void *a, const void *b)
+{
+   const struct sample_file *x = a, *y = b;
+
+   if (x->note != y->note)
+      return x->note - y->note;
+   if (x->velocity != y->velocity)
+      return x->velocity - y->velocity;
+   return x->slot - y->slot;
+}
+
+/* the sample files in sample_dir, sorted by key, layer and slot */
+static struct sample_file *scan_dir(unsigned int *count)
+{
+   struct sample_file *files = NULL, *more;
+   unsigned int n = 0, size = 0;
+   struct dirent *d;
+   DIR *dir;
+
+   dir = opendir(sample_dir);
+   if (!dir) {
+      fprintf(stderr, "%s: opendir(\"%s\"): %s\n", __func__, sample_dir, strerror(errno));
+      exit(1);
+   }
+   while ((d = readdir(dir))) {
+      if (n == size) {
+         size = size ? 2 * size : 256;
+         more = realloc(files, size * sizeof(*files));
+         if (!more) {
+            fprintf(stderr, "%s: Can't malloc memory for the sample index\n", __func__);
+            exit(1);
+         }
+         files = more;
       }
+      if (!parse_name(d->d_name, &files[n]))
+         n++;
+   }
+   closedir(dir);
+   qsort(files, n, sizeof(*files), compare_files);
+   *count = n;
+   return files;
+}
+
+/*
+ * Load every sample in sample_dir.  The files are mapped to learn their
+ * formats, then read once, in order, into the arena, all but the plain
+ * samples --map leaves in their mappings.  A key's velocity layers and
+ * round-robin slots end up next to each other in samples[].
+ */
+void samples_init(void)
+{
+   struct sample_file *files;
+   unsigned int nfiles, i, l;
+   int first[NKEYS] = { 0 }, count[NKEYS] = { 0 }; /* every key's layers */
+   int key, vel, last_note = -1, last_velocity = -1;
+   size_t size = 0, pcm = 0;
+   const char *kind = NULL;
+   char filename[4096];
+
+   if (!sample_dir)
+      return;
 
-      count += frames;
-   } while (count < wave_size);
+   files = scan_dir(&nfiles);
+   samples = calloc(nfiles ? nfiles : 1, sizeof(*samples));
+   layers = calloc(nfiles ? nfiles : 1, sizeof(*layers));
+   if (!samples || !layers) {
+      fprintf(stderr, "%s: Can't malloc memory for the sample index\n", __func__);
+      exit(1);
+   }
+
+   for (i = 0; i < nfiles; i++) {
+      struct sample_t *s = &samples[nsamples];
+
+      snprintf(filename, sizeof(filename), "%s/%s", sample_dir, files[i].name);
+      if (map_sample(filename, s, stream_enabled()) < 0)
+         continue;
+      s->root = files[i].note;
+      pcm += (size_t)s->wave_size * s->channels * (s->sample_bits / 8);
+      size += resident_size(s);
+
+      key = files[i].note - MINMIDINOTE;
+      if (files[i].note != last_note || files[i].velocity != last_velocity) {
+         if (!count[key]++)
+            first[key] = nlayers;
+         layers[nlayers].velocity = files[i].velocity;
+         layers[nlayers].first = nsamples;
+         nlayers++;
+      }
+      layers[nlayers - 1].slots++;
+      last_note = files[i].note;
+      last_velocity = files[i].velocity;
+      nsamples++;
+   }
+   free(files);
+
+   if (!nsamples) {
+      fprintf(stderr, "%s: no samples found in \"%s\"\n", __func__, sample_dir);
+      exit(1);
+   }
+
+   /* a velocity plays the softest layer that reaches it, the loudest one above them all */
+   for (key = 0; key < NKEYS; key++) {
+      if (!count[key])
+         continue; /* map_keys() lends it a neighbour's */
+      for (vel = 0, l = first[key]; vel < 128; vel++) {
+         while (vel > layers[l].velocity && l + 1 < (unsigned int)(first[key] + count[key]))
+            l++;
+         key_layer[key][vel] = l;
+      }
+   }
+
+   if (size) {
+      arena = arena_alloc(size, &kind);
+      for (i = 0, size = 0; i < nsamples; i++)
+         size += keep_frames(&samples[i], arena + size);
+      audio_lock(arena, arena_size);
+   }
+
+   if (verbose) {
+      fprintf(stderr, "Loaded %u samples in %u velocity layers from %s\n", nsamples, nlayers, sample_dir);
+      if (arena)
+         fprintf(stderr, "Sample arena: %.1fMB for %.1fMB of PCM, on %s\n", size / 1048576.0, pcm / 1048576.0, kind);
+      else
+         fprintf(stderr, "Samples: %.1fMB of PCM, mapped\n", pcm / 1048576.0);
+   }
+   map_keys(count);
+   resample_init();
+}
+
+/* write (or rewrite, once data_bytes is known) a WAV header at the start of fd */
+void wav_write_header(int fd, unsigned int channels, unsigned int rate, enum sample_format f, unsigned int data_bytes)
+{
+   unsigned int bits = format_bits[f];
+   struct wav_file_head_t head;
+   struct wav_chunk_head_t fmt_chunk, data_chunk;
+   struct wav_format_t format;
+   struct iovec iov[4];
+   const size_t size = sizeof(head) + sizeof(fmt_chunk) + sizeof(format) + sizeof(data_chunk);
+
+   memcpy(head.id, "RIFF", 4);
+   head.length = 4 + size - sizeof(head) + data_bytes;
+   memcpy(head.type, "WAVE", 4);
+
+   memcpy(fmt_chunk.id, "fmt ", 4);
+   fmt_chunk.length = sizeof(format);
+   format.tag = (f == FMT_FLOAT) ? 3 : WAV_PCM; /* IEEE float or PCM */
+   format.channels = channels;
+   format.sample_rate = rate;
+   format.block_align = channels * bits / 8;
+   format.avg_bytes_per_sec = rate * format.block_align;
+   format.sample_bits = bits;
+
+   memcpy(data_chunk.id, "data", 4);
+   data_chunk.length = data_bytes;
+
+   iov[0].iov_base = &head;       iov[0].iov_len = sizeof(head);
+   iov[1].iov_base = &fmt_chunk;  iov[1].iov_len = sizeof(fmt_chunk);
+   iov[2].iov_base = &format;     iov[2].iov_len = sizeof(format);
+   iov[3].iov_base = &data_chunk; iov[3].iov_len = sizeof(data_chunk);
+   if (pwritev(fd, iov, 4, 0) != (ssize_t)size) {
+      fprintf(stderr, "%s: pwritev: %s\n", __func__, strerror(errno));
+      exit(1);
+   }
+   /* on a fresh file, leave the offset where the data goes */
+   if (lseek(fd, 0, SEEK_CUR) < (off_t)size)
+      lseek(fd, size, SEEK_SET);
+}
+
+void samples_cleanup(void)
+{
+   unsigned int i;
+
+   for (i = 0; i < nsamples; i++) {
+      if (samples[i].fd >= 0)
+         close(samples[i].fd);
+      if (samples[i].map)
+         munmap(samples[i].map, samples[i].map_size);
+   }
+   if (arena)
+      munmap(arena, arena_size);
+   free(samples);
+   free(layers);
+   arena = NULL;
+   samples = NULL;
+   layers = NULL;
+   nsamples = nlayers = 0;
 }
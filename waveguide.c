@@ -0,0 +1,187 @@
+/*
+ *  waveguide.c  digital waveguide string engine of Piano.
+ *
+ *  Copyright (C) 2008 Tigran Aivazian <tigran@bibles.org.uk>
+ *
+ *  Every voice is a string: a delay line closed by a fractional delay
+ *  allpass that tunes it, a one-pole loss filter that makes high partials
+ *  die away faster, and a dispersion allpass that stretches the partials
+ *  like a stiff piano string does.  The hammer blow is the initial shape
+ *  of the string.
+ *
+ *  Strings are rendered WG_LANES at a time, one per SIMD lane.  Their
+ *  delay lines share one array so a lane's read is a gather from it.
+ *  The kernel hands back every lane's output and pan_lanes() mixes them
+ *  into the output channels through the voices' gains.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "piano.h"
+
+#define WG_IDLE   POLYPHONY       /* delay line of lanes with no voice */
+#define WG_BLOCK  64              /* frames of lane output panned at a time */
+
+struct wg_string {
+   int pos;                       /* write position in the delay line */
+   int length;                    /* integer part of the delay */
+   float tune;                    /* fractional delay allpass coefficient */
+   float tune_x, tune_y;          /* its previous input and output */
+   float loss_gain, loss_pole;    /* one-pole loss filter */
+   float loss_y;
+   float disp;                    /* dispersion allpass coefficient */
+   float disp_x, disp_y;
+   unsigned int frames_left;      /* until the string is inaudible */
+};
+
+static float wg_delay[(POLYPHONY + 1) * WG_DELAY] __attribute__((aligned(32)));
+static struct wg_string strings[POLYPHONY];
+
+/* phase delay in frames of the one-pole b / (1 - a z^-1) at w radians per frame */
+static double loss_delay(double a, double w)
+{
+   return atan2(a * sin(w), 1 - a * cos(w)) / w;
+}
+
+/* phase delay of the allpass (d + z^-1) / (1 + d z^-1) */
+static double allpass_delay(double d, double w)
+{
+   return 1 - 2 * atan2(d * sin(w), 1 + d * cos(w)) / w;
+}
+
+/* raised cosine hammer pulse of the given width, centred at c */
+static double hammer(double x, double c, double width)
+{
+   x = (x - c) / width;
+   return (fabs(x) < 0.5) ? 0.5 + 0.5 * cos(2 * M_PI * x) : 0;
+}
+
+void waveguide_start(struct voice *v, const struct tuning *t)
+{
+   double freq = t->freq[v->note];
+   struct wg_string *s = &strings[v->id];
+   float *line = wg_delay + v->id * WG_DELAY;
+   unsigned int rate = get_rate();
+   double key = (double)(v->note - MINMIDINOTE) / (NKEYS - 1); /* 0 bass, 1 treble */
+   double w = 2 * M_PI * freq / rate, period = rate / freq;
+   double t60, frac, width, strike, peak = 0;
+   int i;
+
+   /* bass strings ring long and dark, treble ones short and bright */
+   t60 = 12.0 * pow(0.08, key);
+   s->loss_pole = 0.35 - 0.3 * key;
+   s->loss_gain = pow(10.0, -3.0 / (t60 * freq)) * (1 - s->loss_pole);
+   s->disp = -0.05 - 0.4 * key;
+
+   /* whatever delay the filters don't provide, the line and the tuning allpass do */
+   period -= loss_delay(s->loss_pole, w) + allpass_delay(s->disp, w);
+   s->length = period - 0.5;
+   if (s->length < 2)
+      s->length = 2;
+   if (s->length > WG_DELAY - 1)
+      s->length = WG_DELAY - 1;
+   frac = period - s->length;
+   s->tune = (1 - frac) / (1 + frac);
+
+   /* the hammer is wider in the bass; striking at 1/8 of the string
+      leaves the same notch in the spectrum as on a real piano */
+   width = s->length * (0.3 - 0.2 * key);
+   if (width < 2)
+      width = 2;
+   strike = s->length / 8.0;
+   memset(line, 0, WG_DELAY * sizeof(float));
+   for (i = 0; i < s->length; i++) {
+      line[i] = hammer(i, width, width) - hammer(i, width + strike, width);
+      if (fabs(line[i]) > peak)
+         peak = fabs(line[i]);
+   }
+   for (i = 0; peak > 0 && i < s->length; i++)
+      line[i] /= peak;
+
+   s->pos = s->length;
+   s->tune_x = s->tune_y = 0;
+   s->loss_y = 0;
+   s->disp_x = s->disp_y = 0;
+   s->frames_left = t60 * 1.5 * rate; /* down 90dB */
+}
+
+/* copy string state in and out of SIMD lanes, idle lanes stay silent */
+static void load_lanes(struct wg_lanes *l, struct voice **v, int n)
+{
+   const struct wg_string *s;
+   int i;
+
+   memset(l, 0, sizeof(*l));
+   l->line = wg_delay;
+   for (i = 0; i < WG_LANES; i++) {
+      if (i >= n) {
+         l->base[i] = WG_IDLE * WG_DELAY;
+         l->length[i] = 2;
+         continue;
+      }
+      s = &strings[v[i]->id];
+      l->base[i] = v[i]->id * WG_DELAY;
+      l->pos[i] = s->pos;
+      l->length[i] = s->length;
+      l->tune[i] = s->tune;
+      l->tune_x[i] = s->tune_x;
+      l->tune_y[i] = s->tune_y;
+      l->loss_gain[i] = s->loss_gain;
+      l->loss_pole[i] = s->loss_pole;
+      l->loss_y[i] = s->loss_y;
+      l->disp[i] = s->disp;
+      l->disp_x[i] = s->disp_x;
+      l->disp_y[i] = s->disp_y;
+   }
+}
+
+static void store_lanes(const struct wg_lanes *l, struct voice **v, int n)
+{
+   struct wg_string *s;
+   int i;
+
+   for (i = 0; i < n; i++) {
+      s = &strings[v[i]->id];
+      s->pos = l->pos[i] & WG_MASK;
+      s->tune_x = l->tune_x[i];
+      s->tune_y = l->tune_y[i];
+      s->loss_y = l->loss_y[i];
+      s->disp_x = l->disp_x[i];
+      s->disp_y = l->disp_y[i];
+   }
+}
+
+/* render n strings together into bus, marking those that have died away as finished */
+void waveguide_render_group(struct voice **v, int n, float *bus, int stride, int count)
+{
+   struct wg_lanes l __attribute__((aligned(32)));
+   float out[WG_BLOCK * WG_LANES] __attribute__((aligned(32)));
+   float from[MAXCHANNELS * WG_LANES], to[MAXCHANNELS * WG_LANES];
+   int channels = get_channels();
+   struct wg_string *s;
+   int i, g, k, done, m;
+
+   for (g = 0; g < n; g += WG_LANES) {
+      k = (n - g < WG_LANES) ? n - g : WG_LANES;
+      load_lanes(&l, v + g, k);
+      memset(from, 0, sizeof(from)); /* idle lanes go nowhere */
+      memset(to, 0, sizeof(to));
+      for (done = 0; done < count; done += m) {
+         m = (count - done < WG_BLOCK) ? count - done : WG_BLOCK;
+         kernels.waveguide(&l, out, m);
+         for (i = 0; i < k; i++)
+            voice_gains(v[g + i], from + i, to + i, WG_LANES, done, done + m, count, v[g + i]->amplitude);
+         kernels.pan_lanes(bus + done, stride, channels, out, m, from, to);
+      }
+      store_lanes(&l, v + g, k);
+   }
+
+   for (i = 0; i < n; i++) {
+      s = &strings[v[i]->id];
+      if (s->frames_left > (unsigned int)count)
+         s->frames_left -= count;
+      else
+         v[i]->finished = 1;
+   }
+}
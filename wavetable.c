@@ -0,0 +1,123 @@
+/*
+ *  wavetable.c  band-limited wavetable oscillators of Piano.
+ *
+ *  Copyright (C) 2008 Tigran Aivazian <tigran@bibles.org.uk>
+ *
+ *  There is one table per octave of the keyboard.  Each holds a single
+ *  cycle of the same harmonic waveform, but only with the harmonics that
+ *  stay below Nyquist for the highest frequency the table is used for, so
+ *  high notes never alias.  Voices step through their table with a 32-bit
+ *  fixed point phase accumulator and linear interpolation, which costs the
+ *  same for every key.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "piano.h"
+
+#define WT_BITS   11               /* log2 of the table length */
+#define WT_SIZE   (1 << WT_BITS)
+#define WT_FRAC   (32 - WT_BITS)   /* fractional bits of the phase */
+#define WT_TABLES 8                /* octaves covering A0...C8 */
+#define WT_BASE   27.5             /* A0, bottom of the first octave */
+
+/* one extra point so interpolation never has to wrap */
+static float tables[WT_TABLES][WT_SIZE + 1];
+static unsigned int tables_rate; /* rate the tables were built for */
+
+/* amplitude of the k-th harmonic, a bright tone falling off at 1/k^1.5 */
+static double harmonic_amplitude(int k)
+{
+   return 1.0 / (k * sqrt(k));
+}
+
+static void build_table(float *t, double top_freq, unsigned int rate, const float *sine)
+{
+   int i, k, nharm;
+   double peak = 0;
+   static double acc[WT_SIZE];
+
+   nharm = (rate / 2.0) / top_freq;
+   if (nharm < 1)
+      nharm = 1; /* above Nyquist anyway, keep at least the fundamental */
+
+   memset(acc, 0, sizeof(acc));
+   for (k = 1; k <= nharm; k++) {
+      double a = harmonic_amplitude(k);
+      for (i = 0; i < WT_SIZE; i++)
+         acc[i] += a * sine[(k * i) & (WT_SIZE - 1)];
+   }
+   for (i = 0; i < WT_SIZE; i++)
+      if (fabs(acc[i]) > peak)
+         peak = fabs(acc[i]);
+   for (i = 0; i < WT_SIZE; i++)
+      t[i] = acc[i] / peak;
+   t[WT_SIZE] = t[0];
+}
+
+/* (re)build the tables for the given stream rate */
+void wavetable_init(unsigned int rate)
+{
+   int i;
+   float *sine;
+
+   if (rate == tables_rate)
+      return;
+
+   sine = malloc(WT_SIZE * sizeof(float));
+   if (!sine) {
+      fprintf(stderr, "%s: Can't malloc memory for sine table\n", __func__);
+      exit(1);
+   }
+   for (i = 0; i < WT_SIZE; i++)
+      sine[i] = sin(2.0 * M_PI * i / WT_SIZE);
+   for (i = 0; i < WT_TABLES; i++)
+      build_table(tables[i], WT_BASE * (2 << i), rate, sine);
+   free(sine);
+   tables_rate = rate;
+}
+
+void wavetable_retune(struct voice *v, const struct tuning *t)
+{
+   int i = 0;
+
+   /* the first table whose octave reaches up to the note */
+   while (i < WT_TABLES - 1 && WT_BASE * (2 << i) < t->freq[v->note])
+      i++;
+   v->table = tables[i];
+   /* a key at or above Nyquist can only alias, and its step would not fit */
+   if (t->step[v->note] >= 0.5) {
+      v->table = NULL;
+      v->table_step = 0;
+   } else
+      v->table_step = t->step[v->note] * 4294967296.0;
+}
+
+void wavetable_start(struct voice *v, const struct tuning *t)
+{
+   v->table_phase = 0;
+   wavetable_retune(v, t);
+}
+
+int wavetable_render(struct voice *v, float *out, int count)
+{
+   const float *t = v->table;
+   const float scale = 1.0f / (1 << WT_FRAC);
+   unsigned int phase = v->table_phase, step = v->table_step;
+   unsigned int i;
+   float frac;
+   int n;
+
+   if (!t)
+      return 0; /* muted, see wavetable_retune() */
+   for (n = 0; n < count; n++) {
+      i = phase >> WT_FRAC;
+      frac = (phase & ((1 << WT_FRAC) - 1)) * scale;
+      out[n] += v->amplitude * (t[i] + frac * (t[i + 1] - t[i]));
+      phase += step; /* wraps around at 2^32, i.e. once per cycle */
+   }
+   v->table_phase = phase;
+   return 1;
+}